@@ -36,7 +36,13 @@ void host_Construct(HOST *ph )
 	ph->sock = 0;
 	ph->type = NONE;
 	ph->status=IDLE;
+	ph->cmdline[0]=0;
 	ph->homedir[0]=0;
+	ph->connect_ms = 10000;
+	ph->attempt_ms = 250;
+	ph->resolve_time = ph->connect_time = 0;
+	ph->peer[0] = 0;
+	ph->hThread = NULL;
 	ssh2_Construct(ph);
 }
 void host_Open(HOST *ph, char *port)
@@ -66,7 +72,8 @@ void host_Open(HOST *ph, char *port)
 			reader = sftp;
 		}
 
-		CreateThread(NULL, 0, reader, ph, 0, NULL);
+		if ( ph->hThread!=NULL ) CloseHandle(ph->hThread);
+		ph->hThread = CreateThread(NULL, 0, reader, ph, 0, NULL);
 	}
 	else {
 		if ( strnicmp(port, "disconn", 7)==0 ) host_Close(ph);
@@ -106,32 +113,188 @@ void host_Close(HOST *ph)
 	switch (ph->type ) {
 		case STDIO:	stdio_Close(ph); break;
 		case SERIAL:SetEvent(ph->hExitEvent); break;
-		case TELNET:closesocket(ph->sock); break;
+		case TELNET:if ( ph->status==CONNECTED )	//reactor closes the socket
+						shutdown(ph->sock, SD_BOTH);
+					else
+						closesocket(ph->sock);
+					break;
 		case SFTP:	sftp_Close(ph); break;
 		case SSH:
 		case NETCONF:ssh2_Close(ph); break;
 	}
 }
-void host_Destory()
+void host_Resume(HOST *ph)		//parser has room again for a stalled reader
 {
+	switch ( ph->type ) {
+		case TELNET:reactor_Pause(ph->sock, FALSE); break;
+		case SSH:
+		case NETCONF:ssh2_Wake(ph); break;
+	}							//serial and stdio readers wait on the ring
+}
+void host_Destory(HOST *ph)
+{
+	CloseHandle(ph->mtx_job);
+	CloseHandle(ph->mtx_tun);
+	CloseHandle(ph->mtx_sftp);
+	CloseHandle(ph->mtx_rdir);
+	if ( ph->hThread!=NULL ) CloseHandle(ph->hThread);
+}
+
+/***************************Reactor****************************/
+//one thread polls the sockets of telnet sessions, tunnels and listeners,
+//and calls back when there is input, instead of a blocking thread each
+#define MAXPOLLS 1024
+static WSAPOLLFD poll_fds[MAXPOLLS];	//poll_fds[0] is the wake up socket
+static reactor_callback poll_cbs[MAXPOLLS];
+static void *poll_args[MAXPOLLS];
+static int poll_cnt = 0;
+static SOCKET wake_s = INVALID_SOCKET;
+static volatile SOCKET busy_s = INVALID_SOCKET;	//socket being called back now
+static DWORD reactor_tid = 0;
+static HANDLE mtx_reactor;
+static HANDLE mtx_dns = NULL;			//dns_cache, created by reactor_Init
+DWORD WINAPI reactor(void *pv)
+{
+	static WSAPOLLFD fds[MAXPOLLS];
+	char buf[256];
+
+	while ( TRUE ) {
+		int cnt = 0;
+		if ( WaitForSingleObject(mtx_reactor, INFINITE)==WAIT_OBJECT_0 ) {
+			for ( int i=0; i<poll_cnt; i++ )	//skip paused sockets
+				if ( poll_fds[i].events!=0 ) fds[cnt++] = poll_fds[i];
+			ReleaseMutex(mtx_reactor);
+		}
+		if ( WSAPoll(fds, cnt, -1)==SOCKET_ERROR ) {
+			Sleep(10);
+			continue;
+		}
+		if ( fds[0].revents!=0 ) 	//drain wake ups, poll set has changed
+			while ( recv(wake_s, buf, sizeof(buf), 0)>0 );
+
+		for ( int i=1; i<cnt; i++ ) {
+			if ( fds[i].revents==0 ) continue;
+			reactor_callback cb = NULL;
+			void *arg = NULL;
+			if ( WaitForSingleObject(mtx_reactor, INFINITE)==WAIT_OBJECT_0 ) {
+				for ( int j=1; j<poll_cnt; j++ ) {
+					if ( poll_fds[j].fd==fds[i].fd ) {
+						cb = poll_cbs[j];
+						arg = poll_args[j];
+						busy_s = fds[i].fd;
+						break;
+					}
+				}
+				ReleaseMutex(mtx_reactor);
+			}
+			if ( cb!=NULL ) {
+				cb(fds[i].fd, arg);
+				busy_s = INVALID_SOCKET;
+			}
+		}
+	}
+	return 0;
+}
+void reactor_Wake()
+{
+	send(wake_s, "!", 1, 0);
 }
+SOCKET wake_Socket()	//udp socket connected to itself, to interrupt WSAPoll
+{
+	struct sockaddr_in sa;
+	int salen = sizeof(sa);
+	memset(&sa, 0, salen);
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
+	SOCKET s = socket(AF_INET, SOCK_DGRAM, 0);
+	if ( s==INVALID_SOCKET ) return s;
+	if ( bind(s, (struct sockaddr *)&sa, salen)==SOCKET_ERROR
+		|| getsockname(s, (struct sockaddr *)&sa, &salen)==SOCKET_ERROR
+		|| connect(s, (struct sockaddr *)&sa, salen)==SOCKET_ERROR ) {
+		closesocket(s);
+		return INVALID_SOCKET;
+	}
+	u_long nonblock = 1;
+	ioctlsocket(s, FIONBIO, &nonblock);
+	return s;
+}
+BOOL reactor_Init()
+{
+	mtx_dns = CreateMutex(NULL, FALSE, NULL);	//before any connect
+	wake_s = wake_Socket();
+	if ( wake_s==INVALID_SOCKET ) return FALSE;
+
+	mtx_reactor = CreateMutex(NULL, FALSE, NULL);
+	poll_fds[0].fd = wake_s;
+	poll_fds[0].events = POLLRDNORM;
+	poll_cnt = 1;
+	CreateThread(NULL, 0, reactor, NULL, 0, &reactor_tid);
+	return TRUE;
+}
+BOOL reactor_Add(SOCKET s, reactor_callback cb, void *arg)
+{
+	BOOL rc = FALSE;
+	if ( wake_s==INVALID_SOCKET ) return FALSE;
+	if ( WaitForSingleObject(mtx_reactor, INFINITE)==WAIT_OBJECT_0 ) {
+		if ( poll_cnt<MAXPOLLS ) {
+			poll_fds[poll_cnt].fd = s;
+			poll_fds[poll_cnt].events = POLLRDNORM;
+			poll_fds[poll_cnt].revents = 0;
+			poll_cbs[poll_cnt] = cb;
+			poll_args[poll_cnt] = arg;
+			poll_cnt++;
+			rc = TRUE;
+		}
+		ReleaseMutex(mtx_reactor);
+	}
+	if ( rc ) reactor_Wake();
+	return rc;
+}
+void reactor_Pause(SOCKET s, BOOL bPause)
+{
+	if ( wake_s==INVALID_SOCKET ) return;
+	if ( WaitForSingleObject(mtx_reactor, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( int i=1; i<poll_cnt; i++ ) {
+			if ( poll_fds[i].fd==s ) {
+				poll_fds[i].events = bPause ? 0 : POLLRDNORM;
+				break;
+			}
+		}
+		ReleaseMutex(mtx_reactor);
+	}
+	reactor_Wake();
+}
+void reactor_Del(SOCKET s)		//call before closesocket(s)
+{
+	if ( wake_s==INVALID_SOCKET ) return;
+	if ( WaitForSingleObject(mtx_reactor, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( int i=1; i<poll_cnt; i++ ) {
+			if ( poll_fds[i].fd==s ) {
+				poll_cnt--;
+				poll_fds[i] = poll_fds[poll_cnt];
+				poll_cbs[i] = poll_cbs[poll_cnt];
+				poll_args[i] = poll_args[poll_cnt];
+				break;
+			}
+		}
+		ReleaseMutex(mtx_reactor);
+	}
+	reactor_Wake();
+	if ( GetCurrentThreadId()!=reactor_tid )	//let a running callback
+		while ( busy_s==s ) Sleep(1);			//finish before s is closed
+}
 /***************************Serial*****************************/
 const char SOH = 0x01;
 const char STX = 0x02;
 const char EOT = 0x04;
 const char ACK = 0x06;
 const char NAK = 0x15;
-static unsigned char xmodem_buf[133];
-static unsigned char xmodem_blk;
-static int xmodem_timeout;
-static FILE *xmodem_fp;
-static BOOL bXmodem, xmodem_crc, xmodem_started;
-void block_crc()
+void block_crc(HOST *ph)
 {
 	unsigned short crc = 0;
 	for ( int i=3; i<131; i++ ) {
-		crc = crc ^ xmodem_buf[i] << 8;
+		crc = crc ^ ph->xmodem_buf[i] << 8;
 		for ( int j=0; j<8; j++ ) {
 			if (crc & 0x8000)
 				crc = crc << 1 ^ 0x1021;
@@ -139,80 +302,80 @@ void block_crc()
 				crc = crc << 1;
 		}
 	}
-	xmodem_buf[131] = (crc>>8) & 0xff;
-	xmodem_buf[132] = crc & 0xff;
+	ph->xmodem_buf[131] = (crc>>8) & 0xff;
+	ph->xmodem_buf[132] = crc & 0xff;
  }
 void xmodem_block(HOST *ph)
 {
-	xmodem_buf[0] = SOH;
-	xmodem_buf[1] = ++xmodem_blk;
-	xmodem_buf[2] = 255-xmodem_blk;
-	int cnt = fread( xmodem_buf+3, 1, 128, xmodem_fp);
+	ph->xmodem_buf[0] = SOH;
+	ph->xmodem_buf[1] = ++ph->xmodem_blk;
+	ph->xmodem_buf[2] = 255-ph->xmodem_blk;
+	int cnt = fread( ph->xmodem_buf+3, 1, 128, ph->xmodem_fp);
 	if ( cnt <= 0 ) {
-		xmodem_buf[0] = EOT;
-		fclose(xmodem_fp);
+		ph->xmodem_buf[0] = EOT;
+		fclose(ph->xmodem_fp);
 	}
 	if ( cnt>0 && cnt<128 ) 
-		for ( int i=cnt+3; i<131; i++ ) xmodem_buf[i] = 0;
-	if ( xmodem_crc ) {
-		block_crc();
+		for ( int i=cnt+3; i<131; i++ ) ph->xmodem_buf[i] = 0;
+	if ( ph->xmodem_crc ) {
+		block_crc(ph);
 	}
 	else {
 		unsigned char chksum = 0;
-		for ( int i=3; i<131; i++ ) chksum += xmodem_buf[i];
-		xmodem_buf[131] = chksum;
+		for ( int i=3; i<131; i++ ) chksum += ph->xmodem_buf[i];
+		ph->xmodem_buf[131] = chksum;
 	}
 }
 void xmodem_send(HOST *ph)
 {
-	xmodem_started = TRUE;
-	if ( xmodem_buf[0]==EOT )
-		host_Send(ph, (char *)xmodem_buf, 1);
+	ph->xmodem_started = TRUE;
+	if ( ph->xmodem_buf[0]==EOT )
+		host_Send(ph, (char *)ph->xmodem_buf, 1);
 	else
-		host_Send(ph, (char *)xmodem_buf, xmodem_crc?133:132);
+		host_Send(ph, (char *)ph->xmodem_buf, ph->xmodem_crc?133:132);
 }
 void xmodem_recv(HOST *ph, char op)
 {
 	switch( op ) {
 	case 0:		//nothing received,resend every 10 seconds
-				if ( ++xmodem_timeout%10000==0 && xmodem_started ) {
+				if ( ++ph->xmodem_timeout%10000==0 && ph->xmodem_started ) {
 					xmodem_send(ph);
 					term_Disp(ph->term, "R");
 				}
-				if ( xmodem_timeout>60000 ) {	//timeout after 60 seconds
-					bXmodem = FALSE;
-					fclose(xmodem_fp);
+				if ( ph->xmodem_timeout>60000 ) {	//timeout after 60 seconds
+					ph->bXmodem = FALSE;
+					fclose(ph->xmodem_fp);
 					term_Disp(ph->term, "Aborted\r\n");
 				}
 				break;
-	case 0x06:	xmodem_timeout = 0;				//ACK
-				if ( xmodem_buf[0] == EOT ) {
+	case 0x06:	ph->xmodem_timeout = 0;				//ACK
+				if ( ph->xmodem_buf[0] == EOT ) {
 					term_Disp(ph->term, "Completed\r\n");
-					bXmodem = FALSE;
+					ph->bXmodem = FALSE;
 					return;
 				}
 				xmodem_block(ph);
 				xmodem_send(ph); 
-				if ( xmodem_blk==0 ) term_Disp(ph->term, ".");
+				if ( ph->xmodem_blk==0 ) term_Disp(ph->term, ".");
 				break;
 	case 0x15:	term_Disp(ph->term, "N");		//NAK
 				xmodem_send(ph);
 				break;
 	case 'C':	term_Disp(ph->term, "CRC");		//start CRC
-				xmodem_crc = TRUE; 
-				block_crc();
+				ph->xmodem_crc = TRUE; 
+				block_crc(ph);
 				xmodem_send(ph);
 				break;
 	}
 }
 void xmodem_init(HOST *ph, FILE *fp)
 {
-	xmodem_fp = fp;
-	bXmodem = TRUE;
-	xmodem_crc = FALSE;
-	xmodem_started = FALSE;
-	xmodem_timeout = 0;
-	xmodem_blk = 0;
+	ph->xmodem_fp = fp;
+	ph->bXmodem = TRUE;
+	ph->xmodem_crc = FALSE;
+	ph->xmodem_started = FALSE;
+	ph->xmodem_timeout = 0;
+	ph->xmodem_blk = 0;
 	xmodem_block(ph);
 	term_Disp(ph->term, "xmodem");
 }
@@ -258,22 +421,22 @@ DWORD WINAPI serial(void *pv)
 	ph->hostname = ph->cmdline;
 	ph->type = SERIAL;
 	ph->status=CONNECTED;
-	bXmodem = FALSE;
+	ph->bXmodem = FALSE;
 	term_Title(ph->term, ph->cmdline);
 	term_Disp(ph->term, "connected\r\n");
-	ph->hExitEvent = CreateEventA( NULL, TRUE, FALSE, "COM exit");
+	ph->hExitEvent = CreateEventA( NULL, TRUE, FALSE, NULL);
 	while ( WaitForSingleObject(ph->hExitEvent, 0) == WAIT_TIMEOUT ) {
 		char buf[256];
 		DWORD dwCCH;
 		if ( ReadFile(ph->hSerial, buf, 256, &dwCCH, NULL ) ) {
-			if ( bXmodem ) { 
+			if ( ph->bXmodem ) { 
 				char op = 0;
 				if ( dwCCH>0 ) op = buf[dwCCH-1];
 				xmodem_recv(ph, op);
 				continue;
 			}
 			if ( dwCCH > 0 )
-				term_Parse(ph->term, buf, dwCCH);
+				term_Feed(ph->term, buf, dwCCH, TRUE);
 			else
 				Sleep(1);//give WriteFile a chance to complete
 		}
@@ -292,44 +455,264 @@ comm_close:
 }
 
 /***************Telnet*******************************/
+#define DNS_ADDRS 8
+#define DNS_SLOTS 64
+#define DNS_TTL 60000
+struct dns_entry {					//resolved host, families interleaved
+	char host[256];
+	int cnt;
+	struct sockaddr_storage addr[DNS_ADDRS];
+	DWORD tick;
+};
+static struct dns_entry dns_cache[DNS_SLOTS];
+struct dns_query {					//freed by whoever lets go of it last
+	char host[256];
+	int cnt;
+	struct sockaddr_storage addr[DNS_ADDRS];
+	HANDLE hDone;
+	volatile LONG refs;
+};
+int dns_Order(struct addrinfo *ainfo, struct sockaddr_storage *addr)
+{
+	struct addrinfo *v6[DNS_ADDRS], *v4[DNS_ADDRS];
+	int n6=0, n4=0, cnt=0;
+	for ( struct addrinfo *p=ainfo; p!=NULL; p=p->ai_next ) {
+		if ( p->ai_family==AF_INET6 && n6<DNS_ADDRS ) v6[n6++] = p;
+		if ( p->ai_family==AF_INET  && n4<DNS_ADDRS ) v4[n4++] = p;
+	}
+	//RFC 8305, alternate families starting with the preferred one
+	BOOL bSix = ainfo!=NULL && ainfo->ai_family==AF_INET6;
+	for ( int i6=0, i4=0; cnt<DNS_ADDRS && (i6<n6 || i4<n4); bSix=!bSix ) {
+		struct addrinfo *p = NULL;
+		if ( bSix && i6<n6 ) p = v6[i6++];
+		else if ( !bSix && i4<n4 ) p = v4[i4++];
+		if ( p!=NULL ) memcpy(addr+cnt++, p->ai_addr, p->ai_addrlen);
+	}
+	return cnt;
+}
+void dns_query_Free(struct dns_query *q)
+{
+	if ( InterlockedDecrement(&q->refs)==0 ) {
+		CloseHandle(q->hDone);
+		free(q);
+	}
+}
+DWORD WINAPI dns_thread(void *pv)
+{
+	struct dns_query *q = (struct dns_query *)pv;
+	struct addrinfo hints, *ainfo;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if ( getaddrinfo(q->host, NULL, &hints, &ainfo)==0 ) {
+		q->cnt = dns_Order(ainfo, q->addr);
+		freeaddrinfo(ainfo);
+	}
+	if ( q->cnt>0 && WaitForSingleObject(mtx_dns, INFINITE)==WAIT_OBJECT_0 ) {
+		int slot = 0;					//same host, else the oldest entry
+		for ( int i=0; i<DNS_SLOTS; i++ ) {
+			if ( stricmp(dns_cache[i].host, q->host)==0 ) { slot = i; break; }
+			if ( dns_cache[i].tick<dns_cache[slot].tick ) slot = i;
+		}
+		struct dns_entry *e = dns_cache+slot;
+		strcpy(e->host, q->host);
+		e->cnt = q->cnt;
+		memcpy(e->addr, q->addr, sizeof(e->addr));
+		e->tick = GetTickCount();
+		ReleaseMutex(mtx_dns);
+	}
+	SetEvent(q->hDone);
+	dns_query_Free(q);
+	return 0;
+}
+int dns_Resolve(const char *host, struct sockaddr_storage *addr, DWORD ms)
+{
+	struct addrinfo hints, *ainfo;		//ip literals need no lookup
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	if ( getaddrinfo(host, NULL, &hints, &ainfo)==0 ) {
+		int cnt = dns_Order(ainfo, addr);
+		freeaddrinfo(ainfo);
+		return cnt;
+	}
+	if ( strlen(host)>255 ) return -1;
+
+	int cnt = 0;
+	if ( WaitForSingleObject(mtx_dns, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( int i=0; i<DNS_SLOTS; i++ ) {
+			struct dns_entry *e = dns_cache+i;
+			if ( e->cnt>0 && stricmp(e->host, host)==0
+						  && GetTickCount()-e->tick<DNS_TTL ) {
+				cnt = e->cnt;
+				memcpy(addr, e->addr, cnt*sizeof(*addr));
+				break;
+			}
+		}
+		ReleaseMutex(mtx_dns);
+	}
+	if ( cnt>0 ) return cnt;
+
+	//resolve on a thread so a slow dns server can't outlast the time out
+	struct dns_query *q = (struct dns_query *)malloc(sizeof(*q));
+	if ( q==NULL ) return -1;
+	strcpy(q->host, host);
+	q->cnt = 0;
+	q->refs = 2;
+	q->hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	HANDLE h = CreateThread(NULL, 0, dns_thread, q, 0, NULL);
+	if ( h==NULL ) {
+		CloseHandle(q->hDone);
+		free(q);
+		return -1;
+	}
+	CloseHandle(h);
+	if ( WaitForSingleObject(q->hDone, ms)==WAIT_OBJECT_0 ) {
+		cnt = q->cnt;
+		memcpy(addr, q->addr, cnt*sizeof(*addr));
+	}
+	else 
+		cnt = -2;
+	dns_query_Free(q);
+	return cnt;
+}
+void tcp_Error(TERM *pt, int err)
+{
+	switch ( err ) {
+	case WSAEHOSTUNREACH:
+	case WSAENETUNREACH: 
+		term_Error(pt, "host unreachable"); break;
+	case WSAECONNRESET:  
+		term_Error(pt, "connection reset"); break;
+	case WSAETIMEDOUT:   
+		term_Error(pt, "connection timeout");break;
+	case WSAECONNREFUSED:
+		term_Error(pt, "connection refused");break;
+	default: 
+		term_Error(pt, "connection failure");
+	}
+}
 int host_tcp(HOST *ph )
 {
-	int rc = 0;
-	struct addrinfo *ainfo;
-	if ( getaddrinfo(ph->hostname, NULL, NULL, &ainfo)!=0 ) {
-		term_Disp(ph->term, "invalid ip address or hostname\r\n");
+	struct sockaddr_storage addr[DNS_ADDRS];
+	DWORD start = GetTickCount();
+	DWORD deadline = start+ph->connect_ms;
+	int cnt = dns_Resolve(ph->hostname, addr, ph->connect_ms);
+	ph->resolve_time = GetTickCount()-start;
+	if ( cnt<=0 ) {
+		term_Disp(ph->term, cnt==-2 ? "hostname lookup timed out\r\n" :
+									"invalid ip address or hostname\r\n");
 		return -1;
 	}
-	((struct sockaddr_in *)(ainfo->ai_addr))->sin_port = htons(ph->port);
-
-	ph->sock= socket(ainfo->ai_family, SOCK_STREAM, 0);
 	term_Disp(ph->term, "Trying...");
-	if ( connect(ph->sock, ainfo->ai_addr, ainfo->ai_addrlen)==SOCKET_ERROR ) {
-		switch ( WSAGetLastError() ) {
-		case WSAEHOSTUNREACH:
-		case WSAENETUNREACH: 
-			term_Error(ph->term, "host unreachable"); break;
-		case WSAECONNRESET:  
-			term_Error(ph->term, "connection reset"); break;
-		case WSAETIMEDOUT:   
-			term_Error(ph->term, "connection timeout");break;
-		case WSAECONNREFUSED:
-			term_Error(ph->term, "connection refused");break;
-		default: 
-			term_Error(ph->term, "connection failure");
+
+	//staggered connects, a new attempt every attempt_ms or as soon as one
+	//fails, the first to complete wins
+	SOCKET s[DNS_ADDRS];
+	int started = 0, pending = 0, err = WSAETIMEDOUT, win = -1;
+	DWORD now = GetTickCount(), next = now;
+	while ( win==-1 && (int)(deadline-now)>0 ) {
+		if ( started<cnt && ((int)(next-now)<=0 || pending==0) ) {
+			int i = started++;
+			struct sockaddr *sa = (struct sockaddr *)(addr+i);
+			int salen = sizeof(struct sockaddr_in);
+			if ( sa->sa_family==AF_INET6 ) {
+				((struct sockaddr_in6 *)sa)->sin6_port = htons(ph->port);
+				salen = sizeof(struct sockaddr_in6);
+			}
+			else 
+				((struct sockaddr_in *)sa)->sin_port = htons(ph->port);
+			s[i] = socket(sa->sa_family, SOCK_STREAM, 0);
+			u_long nonblock = 1;
+			ioctlsocket(s[i], FIONBIO, &nonblock);
+			if ( connect(s[i], sa, salen)==0 ) 
+				win = i;
+			else if ( WSAGetLastError()==WSAEWOULDBLOCK ) 
+				pending++;
+			else {
+				err = WSAGetLastError();
+				closesocket(s[i]);
+				s[i] = INVALID_SOCKET;
+			}
+			next = now+ph->attempt_ms;
+			continue;
 		}
-		closesocket(ph->sock);
+		if ( pending==0 ) break;		//all tried and failed
+
+		fd_set wset, eset;
+		FD_ZERO(&wset);
+		FD_ZERO(&eset);
+		for ( int i=0; i<started; i++ ) if ( s[i]!=INVALID_SOCKET ) {
+			FD_SET(s[i], &wset);
+			FD_SET(s[i], &eset);
+		}
+		DWORD wait = deadline-now;
+		if ( started<cnt && next-now<wait ) wait = next-now;
+		struct timeval tv = { wait/1000, (wait%1000)*1000 };
+		if ( select(0, NULL, &wset, &eset, &tv)>0 ) {
+			for ( int i=0; i<started && win==-1; i++ ) {
+				if ( s[i]==INVALID_SOCKET ) continue;
+				if ( !FD_ISSET(s[i], &wset) && !FD_ISSET(s[i], &eset) ) continue;
+				int so_err = 0, len = sizeof(so_err);
+				getsockopt(s[i], SOL_SOCKET, SO_ERROR, (char *)&so_err, &len);
+				if ( so_err==0 && FD_ISSET(s[i], &wset) ) {
+					win = i;
+					break;
+				}
+				err = so_err!=0 ? so_err : WSAECONNREFUSED;
+				closesocket(s[i]);
+				s[i] = INVALID_SOCKET;
+				pending--;
+				next = GetTickCount();	//next address right away
+			}
+		}
+		now = GetTickCount();
+	}
+	for ( int i=0; i<started; i++ ) 
+		if ( i!=win && s[i]!=INVALID_SOCKET ) closesocket(s[i]);
+	ph->connect_time = GetTickCount()-start;
+	if ( win==-1 ) {
+		tcp_Error(ph->term, err);
 		ph->sock = 0;
-		rc = -1;
+		return -1;
 	}
-	freeaddrinfo(ainfo);
 
-	return rc;
+	u_long nonblock = 0;				//readers and libssh2 expect blocking
+	ioctlsocket(s[win], FIONBIO, &nonblock);
+	ph->sock = s[win];
+	struct sockaddr *sa = (struct sockaddr *)(addr+win);
+	void *ip = sa->sa_family==AF_INET6 ? 
+					(void *)&((struct sockaddr_in6 *)sa)->sin6_addr :
+					(void *)&((struct sockaddr_in *)sa)->sin_addr;
+	inet_ntop(sa->sa_family, ip, ph->peer, sizeof(ph->peer));
+	return 0;
+}
+void telnet_read(SOCKET s, void *pv)
+{
+	HOST *ph = (HOST *)pv;
+	char buf[4096];
+	int room = term_Room(ph->term);
+	if ( room==0 ) {			//parser is behind, stop polling until resumed
+		reactor_Pause(s, TRUE);
+		if ( term_Room(ph->term)>0 ) reactor_Pause(s, FALSE);
+		return;
+	}
+	int cnt = recv(s, buf, min(room, 4096), 0);
+	if ( cnt>0 ) {
+		term_Feed(ph->term, buf, cnt, FALSE);
+		return;
+	}
+	reactor_Del(s);
+	closesocket(s);
+	ph->sock = 0;
+	ph->type = NONE;
+	term_Error(ph->term, "Disconnected");
+	ph->status=IDLE;
+	term_Title(ph->term, "");
 }
 DWORD WINAPI telnet(void *pv)
 {
 	HOST *ph = (HOST *)pv;
-	char port[256];
+	char *port = ph->hostbuf;		//outlives this thread
 	strcpy( port, ph->cmdline+7);
 	ph->hostname = port;
 	ph->port = 23;
@@ -347,15 +730,15 @@ DWORD WINAPI telnet(void *pv)
 		ph->type=TELNET;
 		ph->status=CONNECTED;
 		term_Disp(ph->term, "connected\r\n");
+		if ( reactor_Add(ph->sock, telnet_read, ph) ) 
+			return 1;				//reader thread is done, reactor takes over
 
-		char buf[4096];
+		char buf[4096];				//reactor is full, read on this thread
 		int cnt;
-		while ( (cnt=recv(ph->sock, buf, 4096, 0)) > 0 ) {
-			term_Parse(ph->term, buf, cnt);
-		}
+		while ( (cnt=recv(ph->sock, buf, 4096, 0)) > 0 ) 
+			term_Feed(ph->term, buf, cnt, TRUE);
 		closesocket(ph->sock);
 		ph->sock = 0;
-
 		ph->type = NONE;
 		term_Error(ph->term, "Disconnected");
 	}
@@ -366,13 +749,12 @@ DWORD WINAPI telnet(void *pv)
 }
 
 /***************************STDIO*******************************/
-static PROCESS_INFORMATION piStd;
 DWORD WINAPI stdio( void *pv)
 {
 	HOST *ph = (HOST *)pv;
 	HANDLE Stdin_Rd, Stdin_Wr ;
 	HANDLE Stdout_Rd, Stdout_Wr, Stderr_Wr;
-	memset(&piStd, 0, sizeof(PROCESS_INFORMATION));
+	memset(&ph->piStd, 0, sizeof(PROCESS_INFORMATION));
 
 	SECURITY_ATTRIBUTES saAttr;
 	saAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
@@ -414,7 +796,7 @@ DWORD WINAPI stdio( void *pv)
 						NULL,			// use parent's environment
 						NULL,			// use parent's current directory
 						&siStartInfo,	// STARTUPINFO pointer
-						&piStd) ) {		// receives PROCESS_INFORMATION
+						&ph->piStd) ) {	// receives PROCESS_INFORMATION
 		CloseHandle(Stdin_Rd);
 		CloseHandle(Stdout_Wr);
 		CloseHandle(Stderr_Wr);
@@ -426,7 +808,7 @@ DWORD WINAPI stdio( void *pv)
 			char buf[4096];
 			if ( ReadFile(ph->hStdioRead, buf, 4096, &dwCCH, NULL) > 0 ) {
 				if ( dwCCH > 0 )
-					term_Parse(ph->term, buf, dwCCH);
+					term_Feed(ph->term, buf, dwCCH, TRUE);
 				else
 					Sleep(1);
 			}
@@ -446,10 +828,10 @@ DWORD WINAPI stdio( void *pv)
 }
 void stdio_Close(HOST *ph)
 {
-	if ( WaitForSingleObject(piStd.hProcess, 100)==WAIT_TIMEOUT )
-		TerminateProcess(piStd.hProcess,0);
-	CloseHandle(piStd.hThread);
-	CloseHandle(piStd.hProcess);
+	if ( WaitForSingleObject(ph->piStd.hProcess, 100)==WAIT_TIMEOUT )
+		TerminateProcess(ph->piStd.hProcess,0);
+	CloseHandle(ph->piStd.hThread);
+	CloseHandle(ph->piStd.hProcess);
 }
 
 /**********************************HTTPd*******************************/
@@ -528,67 +910,103 @@ int url_decode(char *url)
 	return q-url;
 }
 
-DWORD WINAPI httpd( void *pv )
+DWORD WINAPI httpd_conn( void *pv )
 {
 	char buf[4096], *cmd, *reply;
-	struct sockaddr_in cltaddr;
-	int addrsize=sizeof(cltaddr), cmdlen, replen;
-	SOCKET http_s0 = *(SOCKET *)pv;
+	int cmdlen, replen;
+	SOCKET http_s1 = (SOCKET)(UINT_PTR)pv;
 
-	while ( TRUE ) {
-		SOCKET http_s1 = accept(http_s0, (struct sockaddr*)&cltaddr, &addrsize);
-		if ( http_s1 == INVALID_SOCKET ) break;
-		cmdlen=recv(http_s1, buf, 4095, 0);
-		if ( cmdlen>0 ) {
-			if ( strncmp(buf, "GET /", 5)!=0 ) {//TCP connection
-				term_Send(pt, buf, cmdlen);
-				do {
-					if ( host_Status(pt->host)==CONNECTED ) {
-						replen = term_Recv(pt,  &reply);
-						if ( replen > 0 ) send(http_s1, reply, replen, 0);
-					}
-					struct timeval tv = { 0, 100 }; //tv_sec=0, tv_usec=100
-					FD_SET readset;
-					FD_ZERO(&readset);
-					FD_SET(http_s1, &readset);
-					if ( select(1, &readset, NULL, NULL, &tv)>0 ) {
-						cmdlen = recv(http_s1, buf, 4095, 0);
-						if ( cmdlen>0 ) 
-							term_Send(pt, buf, cmdlen);
-					}
-				} while (cmdlen>0);
+	cmdlen=recv(http_s1, buf, 4095, 0);
+	if ( cmdlen>0 ) {
+		if ( strncmp(buf, "GET /", 5)!=0 ) {//TCP connection to main session
+			TERM *pt = session_Get(0, FALSE);
+			if ( pt!=NULL ) term_Send(pt, buf, cmdlen);
+			else cmdlen = 0;
+			while ( cmdlen>0 ) {
+				if ( host_Status(pt->host)==CONNECTED ) {
+					replen = term_Recv(pt,  &reply);
+					if ( replen > 0 ) send(http_s1, reply, replen, 0);
+				}
+				struct timeval tv = { 0, 100 }; //tv_sec=0, tv_usec=100
+				FD_SET readset;
+				FD_ZERO(&readset);
+				FD_SET(http_s1, &readset);
+				if ( select(1, &readset, NULL, NULL, &tv)>0 ) {
+					cmdlen = recv(http_s1, buf, 4095, 0);
+					if ( cmdlen>0 )
+						term_Send(pt, buf, cmdlen);
+				}
 			}
-			else {								//HTTP connection
-				do {
-					buf[cmdlen] = 0;
-					cmd = buf+5;
-					char *p=strchr(cmd, ' ');
-					if ( p!=NULL ) *p = 0;
-					url_decode(cmd);
+			if ( pt!=NULL ) session_Put(pt);
+		}
+		else {								//HTTP connection
+			do {
+				buf[cmdlen] = 0;
+				cmd = buf+5;
+				char *p=strchr(cmd, ' ');
+				if ( p!=NULL ) *p = 0;
+				url_decode(cmd);
 
-					if ( *cmd=='?' ) {	//get CGI, cmd+1 points to command
-						replen = term_Cmd(pt,  cmd+1, &reply);
-						int len = sprintf(buf, HEADER, replen);
-						send(http_s1, buf, len, 0);
-						if ( replen>0 ) send(http_s1, reply, replen, 0);
+				int id = 0;					//GET /?cmd goes to session 0
+				for ( p=cmd; isdigit(*p); p++ );
+				if ( p>cmd && *p=='?' ) {	//GET /N?cmd goes to session N
+					id = atoi(cmd);
+					cmd = p;
+				}
+				if ( *cmd=='?' ) {	//get CGI, cmd+1 points to command
+					BOOL bExit = id>0 && strncmp(cmd+1, "!Exit", 5)==0;
+					TERM *pt = session_Get(id, !bExit);
+					replen = 0;
+					if ( pt==NULL ) {
+						reply = "no such session\n";
+						replen = strlen(reply);
 					}
-					else {				//get file, cmd points to filename
-						httpFile(http_s1, cmd);
+					else if ( bExit ) {
+						session_Free(id);
 					}
-					cmdlen = recv(http_s1, buf, 4095, 0);
-				} while ( cmdlen>0);
-			}
+					else if ( WaitForSingleObject(pt->mtx_cmd, INFINITE)
+														==WAIT_OBJECT_0 ) {
+						replen = term_Cmd(pt,  cmd+1, &reply);
+						ReleaseMutex(pt->mtx_cmd);
+					}
+					int len = sprintf(buf, HEADER, replen);
+					send(http_s1, buf, len, 0);
+					if ( replen>0 ) send(http_s1, reply, replen, 0);
+					if ( pt!=NULL ) session_Put(pt);	//reply is in pt
+				}
+				else {				//get file, cmd points to filename
+					httpFile(http_s1, cmd);
+				}
+				cmdlen = recv(http_s1, buf, 4095, 0);
+			} while ( cmdlen>0);
 		}
-		shutdown(http_s1, SD_SEND);
-		closesocket(http_s1);
 	}
+	shutdown(http_s1, SD_SEND);
+	closesocket(http_s1);
 	return 0;
 }
+void httpd_accept(SOCKET http_s0, void *pv)
+{
+	struct sockaddr_in cltaddr;
+	int addrsize=sizeof(cltaddr);
+
+	SOCKET http_s1 = accept(http_s0, (struct sockaddr*)&cltaddr, &addrsize);
+	if ( http_s1 == INVALID_SOCKET ) return;
+
+	//one thread per connection, as a command may wait for its prompt
+	HANDLE hThread = CreateThread(NULL, 0, httpd_conn,
+						(LPVOID)(UINT_PTR)http_s1, 0, NULL);
+	if ( hThread!=NULL )
+		CloseHandle(hThread);
+	else
+		closesocket(http_s1);
+}
 int http_Svr(char *intf)
 {
 static SOCKET http_s0=INVALID_SOCKET;
 
 	if ( http_s0 !=INVALID_SOCKET ) {
+		reactor_Del(http_s0);
 		closesocket(http_s0);
 		http_s0 = INVALID_SOCKET;
 		return 0;
@@ -606,10 +1024,8 @@ static SOCKET http_s0=INVALID_SOCKET;
 	for ( p=8080; p<8099; p++ ) {
 		svraddr.sin_port=htons(p);
 		if ( bind(http_s0, (struct sockaddr*)&svraddr, addrsize)!=SOCKET_ERROR ) {
-			if ( listen(http_s0, 1)!=SOCKET_ERROR){
-				DWORD dwThreadId;
-				CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)httpd,
-											&http_s0, 0, &dwThreadId);
+			if ( listen(http_s0, SOMAXCONN)!=SOCKET_ERROR
+				&& reactor_Add(http_s0, httpd_accept, NULL) ) {
 				return p;
 			}
 		}
@@ -618,9 +1034,135 @@ static SOCKET http_s0=INVALID_SOCKET;
 	http_s0 = INVALID_SOCKET;
 	return 0;
 }
+/**********************************Sessions*******************************/
+static TERM *sessions[MAXSESSIONS];
+static HANDLE mtx_sessions = NULL;
+int session_Add(TERM *pt)
+{
+	int id = -1;
+	if ( mtx_sessions==NULL ) mtx_sessions = CreateMutex(NULL, FALSE, NULL);
+	if ( WaitForSingleObject(mtx_sessions, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( int i=0; i<MAXSESSIONS; i++ ) {
+			if ( sessions[i]==NULL ) {
+				sessions[i] = pt;
+				pt->id = id = i;
+				pt->refs = 1;
+				break;
+			}
+		}
+		ReleaseMutex(mtx_sessions);
+	}
+	return id;
+}
+TERM *session_Create(int id)	//headless session for scripting, small buffer
+{
+	TERM *pt = (TERM *)malloc(sizeof(TERM));
+	HOST *ph = (HOST *)malloc(sizeof(HOST));
+	if ( pt!=NULL && ph!=NULL ) {
+		if ( term_Construct(pt, MAXLINES/16) ) {
+			host_Construct(ph);
+			pt->id = id;
+			pt->bHeadless = TRUE;
+			pt->refs = 1;					//held by the session slot
+			pt->host = ph;
+			ph->term = pt;
+			return pt;
+		}
+		term_Destruct(pt);
+	}
+	free(pt);
+	free(ph);
+	return NULL;
+}
+TERM *session_Get(int id, BOOL bCreate)
+{
+	TERM *pt = NULL;
+	if ( id<0 || id>=MAXSESSIONS || mtx_sessions==NULL ) return NULL;
+	if ( WaitForSingleObject(mtx_sessions, INFINITE)==WAIT_OBJECT_0 ) {
+		if ( sessions[id]==NULL && bCreate ) 
+			sessions[id] = session_Create(id);
+		pt = sessions[id];
+		if ( pt!=NULL ) InterlockedIncrement(&pt->refs);
+		ReleaseMutex(mtx_sessions);
+	}
+	return pt;
+}
+void ftp_Release(TERM *pt);
+void tftp_Release(TERM *pt);
+void session_Put(TERM *pt)		//drop a reference, the last one frees it
+{
+	if ( InterlockedDecrement(&pt->refs)>0 ) return;
+
+	HOST *ph = pt->host;
+	ftp_Release(pt);
+	tftp_Release(pt);
+	xfer_Drop(ph);
+	host_Destory(ph);
+	term_Destruct(pt);
+	free(ph);
+	free(pt);
+}
+BOOL session_Free(int id)
+{
+	TERM *pt = NULL;
+	if ( id<0 || id>=MAXSESSIONS || mtx_sessions==NULL ) return FALSE;
+	if ( WaitForSingleObject(mtx_sessions, INFINITE)==WAIT_OBJECT_0 ) {
+		if ( sessions[id]!=NULL && sessions[id]->bHeadless ) {
+			pt = sessions[id];
+			sessions[id] = NULL;
+		}
+		ReleaseMutex(mtx_sessions);
+	}
+	if ( pt==NULL ) return FALSE;
+
+	HOST *ph = pt->host;
+	if ( host_Status(ph)!=IDLE ) {
+		host_Close(ph);
+		for ( int i=0; i<50 && host_Status(ph)!=IDLE; i++ ) Sleep(100);
+	}
+	if ( ph->hThread!=NULL ) WaitForSingleObject(ph->hThread, INFINITE);
+	session_Put(pt);				//freed when the last caller lets go
+	return TRUE;
+}
+//connected ssh session, with a reference the caller drops by session_Put
+HOST *session_Find(const char *hostname, short port)
+{
+	HOST *found = NULL;
+	if ( mtx_sessions==NULL ) return NULL;
+	if ( WaitForSingleObject(mtx_sessions, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( int i=0; i<MAXSESSIONS && found==NULL; i++ ) {
+			HOST *ph = sessions[i]==NULL ? NULL : sessions[i]->host;
+			if ( ph==NULL || ph->type!=SSH || ph->status!=CONNECTED ) continue;
+			if ( ph->port==port && stricmp(ph->hostname, hostname)==0 ) {
+				InterlockedIncrement(&sessions[i]->refs);
+				found = ph;
+			}
+		}
+		ReleaseMutex(mtx_sessions);
+	}
+	return found;
+}
+void session_List(TERM *pt)
+{
+	const char *types[] = {"none", "stdio", "serial", "telnet",
+							"ssh", "sftp", "netconf"};
+	const char *status[] = {"idle", "connecting", "authenticating",
+							"connected"};
+	if ( WaitForSingleObject(mtx_sessions, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( int i=0; i<MAXSESSIONS; i++ ) {
+			HOST *ph = sessions[i]==NULL ? NULL : sessions[i]->host;
+			if ( ph==NULL ) continue;
+			term_Print(pt, "%3d %-8s%-16s%s\n", i, types[ph->type],
+						status[ph->status], ph->cmdline);
+		}
+		ReleaseMutex(mtx_sessions);
+	}
+}
 /**********************************FTPd*******************************/
 static SOCKET ftp_s0 = INVALID_SOCKET;
 static SOCKET ftp_s1 = INVALID_SOCKET;
+static TERM *ftp_pt = NULL;
+static HANDLE ftp_thread = NULL;
 int sock_select( SOCKET s, int secs )
 {
 	struct timeval tv = { 0, 0 };
@@ -634,7 +1176,7 @@ void sock_send(char *reply)
 {
 	send(ftp_s1, reply, strlen(reply), 0);
 }
-BOOL is_directory(char *root)
+BOOL is_directory(TERM *pt, char *root)
 {
 	struct stat sb;
 	if ( stat(root, &sb)==-1 ) {
@@ -661,7 +1203,7 @@ DWORD WINAPI ftpd(LPVOID p)
 	int addrsize=sizeof(clientaddr);
 
 	strcpy( rootDir, (char*)p);
-	term_Print(pt,  "FTPd started at %s\r\n", rootDir);
+	term_Print(ftp_pt,  "FTPd started at %s\r\n", rootDir);
 
 	int ret0, ret1;
 	while( (ret0=sock_select(ftp_s0, 900)) == 1 ) {
@@ -671,20 +1213,21 @@ DWORD WINAPI ftpd(LPVOID p)
 
 		sock_send("220 Welcome\n");
 		getpeername(ftp_s1, (struct sockaddr *)&clientaddr, &addrsize);
-		term_Print(pt, "FTPd: connected from %s\n",
+		term_Print(ftp_pt, "FTPd: connected from %s\n",
 						inet_ntoa(clientaddr.sin_addr));
 
 		FILE *fp;
+		unsigned long long lRest = 0;		//offset given by REST for stor/retr
 		bPassive = FALSE;
 		BOOL bUser=FALSE, bPass=FALSE;
 		while ( (ret1=sock_select(ftp_s1, 300)) == 1 ) {
 			int cnt=recv(ftp_s1, szBuf, 1024, 0);
 			if ( cnt<=0 ) {
-				term_Disp(pt,  "FTPd: client disconnected\n");
+				term_Disp(ftp_pt,  "FTPd: client disconnected\n");
 				break;
 			}
 			szBuf[cnt--]=0;
-			term_Disp(pt, szBuf);
+			term_Disp(ftp_pt, szBuf);
 			while (szBuf[cnt]=='\r' || szBuf[cnt]=='\n' ) szBuf[cnt--]=0;
 			if ( (param=strchr(szBuf, ' '))!=NULL )
 				*param++=0;
@@ -743,7 +1286,7 @@ DWORD WINAPI ftpd(LPVOID p)
 					sock_send("550 Invalid path\n");
 					continue;
 				}
-				if ( !is_directory( fullDir ) ) {
+				if ( !is_directory(ftp_pt, fullDir) ) {
 					sock_send("550 No such directory\n");
 					continue;
 				}
@@ -783,10 +1326,10 @@ DWORD WINAPI ftpd(LPVOID p)
 				bPassive=TRUE;
 			}
 			else if( stricmp("nlst", szBuf)==0 || stricmp("list", szBuf)==0 ){
-				struct _finddata_t  ffblk;
+				struct _finddatai64_t  ffblk;
 				if ( *(param+strlen(param)-1)=='/') strcat(fn, "*.*");
 				if ( *param==0 ) strcat(fn, "\\*.*");
-				intptr_t hFile = _findfirst(fn, &ffblk);
+				intptr_t hFile = _findfirsti64(fn, &ffblk);
 				if ( hFile==-1 ) {
 					sock_send("550 No such file or directory\n");
 					continue;
@@ -814,19 +1357,34 @@ DWORD WINAPI ftpd(LPVOID p)
 							sprintf(szBuf, "%s %s %s\r\n", buf+4,
 										"       <DIR>", ffblk.name);
 						else
-							sprintf(szBuf, "%s % 12ld %s\r\n", buf+4,
+							sprintf(szBuf, "%s % 12lld %s\r\n", buf+4,
 											ffblk.size, ffblk.name);
 					}
 					send(s2, szBuf, strlen(szBuf), 0);
-				} while ( _findnext(hFile, &ffblk)==0);
+				} while ( _findnexti64(hFile, &ffblk)==0);
 				_findclose(hFile);
 				sock_send("226 Transfer complete.\n");
 				closesocket(s2);
 			}
+			else if(stricmp("rest", szBuf) == 0){
+				lRest = _strtoui64(param, NULL, 10);
+				sprintf(szBuf, "350 Restarting at %llu\n", lRest);
+				sock_send(szBuf);
+			}
 			else if(stricmp("stor", szBuf) == 0){
 				fp = NULL;
-				if ( strstr(param, ".." )==NULL )
-					fp = fopen_utf8(fn, "wb");
+				if ( strstr(param, ".." )==NULL ) {
+					if ( lRest>0 ) {			//append to what was received
+						fp = fopen_utf8(fn, "r+b");
+						if ( fp!=NULL && _fseeki64(fp, lRest, SEEK_SET)!=0 ) {
+							fclose(fp);
+							fp = NULL;
+						}
+					}
+					else
+						fp = fopen_utf8(fn, "wb");
+				}
+				lRest = 0;
 				if(fp == NULL){
 					sock_send("550 Unable write file\n");
 					continue;
@@ -840,7 +1398,7 @@ DWORD WINAPI ftpd(LPVOID p)
 					connect(s2, (struct sockaddr *)&clientaddr,
 											sizeof(clientaddr));
 				}
-				unsigned long  lSize = 0;
+				unsigned long long lSize = 0;
 				unsigned int   nLen=0, nCnt=0;
 				do {
 					nLen = recv(s2, szBuf, 32768, 0);
@@ -849,12 +1407,12 @@ DWORD WINAPI ftpd(LPVOID p)
 						fwrite(szBuf, nLen, 1, fp);
 					}
 					if ( ++nCnt==256 ) {
-						term_Print(pt, "\r%lu bytes received", lSize);
+						term_Print(ftp_pt, "\r%llu bytes received", lSize);
 						nCnt = 0;
 					}
 				}while ( nLen!=0);
 				fclose(fp);
-				term_Print(pt, "\r%lu bytes received\n", lSize);
+				term_Print(ftp_pt, "\r%llu bytes received\n", lSize);
 				sock_send("226 Transfer complete\n");
 				closesocket(s2);
 			}
@@ -862,6 +1420,11 @@ DWORD WINAPI ftpd(LPVOID p)
 				fp = NULL;
 				if ( strstr(param, ".." )==NULL )
 					fp = fopen_utf8(fn, "rb");
+				if ( fp!=NULL && lRest>0 && _fseeki64(fp, lRest, SEEK_SET)!=0 ) {
+					fclose(fp);
+					fp = NULL;
+				}
+				lRest = 0;
 				if(fp == NULL) {
 					sock_send("550 Unable to read file\n");
 					continue;
@@ -875,29 +1438,29 @@ DWORD WINAPI ftpd(LPVOID p)
 					connect(s2, (struct sockaddr *)&clientaddr,
 											sizeof(clientaddr));
 				}
-				unsigned long  lSize = 0;
+				unsigned long long lSize = 0;
 				unsigned int   nLen=0, nCnt=0;
 				do {
 					nLen = fread(szBuf, 1, 32768, fp);
 					if ( send(s2, szBuf, nLen, 0) == 0) break;
 					lSize += nLen;
 					if ( ++nCnt==32 ) {
-						term_Print(pt, "\r%lu bytes sent", lSize);
+						term_Print(ftp_pt, "\r%llu bytes sent", lSize);
 						nCnt = 0;
 					}
 				}
 				while ( nLen==32768);
 				fclose(fp);
-				term_Print(pt, "\r%lu bytes sent\n", lSize);
+				term_Print(ftp_pt, "\r%llu bytes sent\n", lSize);
 				sock_send("226 Transfer complete\n");
 				closesocket(s2);
 			}
 			else if(stricmp("size", szBuf) == 0){
-				struct _finddata_t  ffblk;
-				intptr_t  hFile = _findfirst(fn, &ffblk);
+				struct _finddatai64_t  ffblk;
+				intptr_t  hFile = _findfirsti64(fn, &ffblk);
 				if ( hFile!=-1 )
 				{
-					sprintf(szBuf, "213 %lu\n", ffblk.size);
+					sprintf(szBuf, "213 %lld\n", ffblk.size);
 					sock_send(szBuf);
 					_findclose(hFile);
 				}
@@ -930,17 +1493,17 @@ DWORD WINAPI ftpd(LPVOID p)
 		}
 		if( ret1 == 0 ) {
 			sock_send("500 Timeout\n");
-			term_Disp(pt,  "FTPd: client timed out\n");
+			term_Disp(ftp_pt,  "FTPd: client timed out\n");
 		}
 		closesocket(ftp_s1);
 	}
-	term_Disp(pt,  ret0==0? "FTPd timed out\n" : "FTPd stopped\n");
+	term_Disp(ftp_pt,  ret0==0? "FTPd timed out\n" : "FTPd stopped\n");
 	closesocket(ftp_s0);
 	ftp_s0 = INVALID_SOCKET;
 	ftpd_quit();
 	return 0;
 }
-BOOL ftp_Svr(char *root)
+BOOL ftp_Svr(TERM *pt, char *root)
 {
 	if ( root==NULL ) {
 		if ( ftp_s0 != INVALID_SOCKET ) {
@@ -950,7 +1513,8 @@ BOOL ftp_Svr(char *root)
 		}
 	}
 	else {
-		if ( is_directory( root ) ) {
+		if ( is_directory(pt, root) ) {
+			ftp_pt = pt;
 			struct sockaddr_in serveraddr;
 			int addrsize=sizeof(serveraddr);
 			ftp_s0 = socket(AF_INET, SOCK_STREAM, 0);
@@ -962,7 +1526,9 @@ BOOL ftp_Svr(char *root)
 									addrsize) != SOCKET_ERROR ) {
 				if ( listen(ftp_s0, 1) != SOCKET_ERROR ) {
 					DWORD dwId;
-					CreateThread( NULL, 0, ftpd, (LPVOID)root, 0, &dwId);
+					if ( ftp_thread!=NULL ) CloseHandle(ftp_thread);
+					ftp_thread = CreateThread( NULL, 0, ftpd, (LPVOID)root, 
+																0, &dwId);
 					return TRUE;
 				}
 			}
@@ -972,8 +1538,17 @@ BOOL ftp_Svr(char *root)
 	}
 	return FALSE;
 }
+void ftp_Release(TERM *pt)		//pt is being freed, stop the FTPd it started
+{
+	if ( ftp_pt!=pt ) return;
+	ftp_pt = sessions[0];		//main window, for the last messages
+	ftp_Svr(pt, NULL);
+	if ( ftp_thread!=NULL ) WaitForSingleObject(ftp_thread, 5000);
+}
 
 static SOCKET tftp_s0=INVALID_SOCKET, tftp_s1;
+static TERM *tftp_pt = NULL;
+static HANDLE tftp_thread = NULL;
 void tftp_Read( FILE *fp )
 {
 	char dataBuf[516], ackBuf[516];
@@ -986,7 +1561,7 @@ void tftp_Read( FILE *fp )
 		dataBuf[0]=0; dataBuf[1]=3;
 		dataBuf[2]=(nCnt>>8)&0xff; dataBuf[3]=nCnt&0xff;
 		send(tftp_s1, dataBuf, nLen+4, 0);
-		if ( nCnt%512==0 ) term_Disp(pt, "#");
+		if ( nCnt%512==0 ) term_Disp(tftp_pt, "#");
 		if ( sock_select( tftp_s1, 5 ) == 1 ) {
 			if ( recv(tftp_s1, ackBuf, 516, 0)==SOCKET_ERROR ) break;
 			if ( ackBuf[1]==4 && ackBuf[2]==dataBuf[2] &&
@@ -1000,7 +1575,7 @@ void tftp_Read( FILE *fp )
 		}
 		else if ( ++nRetry==5 ) break;
 	} while ( len==512);
-	if ( nCnt>=512 ) term_Disp(pt, "\n");
+	if ( nCnt>=512 ) term_Disp(tftp_pt, "\n");
 }
 void tftp_Write( FILE *fp )
 {
@@ -1021,13 +1596,13 @@ void tftp_Write( FILE *fp )
 				fwrite(dataBuf+4, 1, nLen-4, fp);
 				nRetry=0;
 				nCnt++;
-				if ( nCnt%512==0 ) term_Disp(pt, "#");
+				if ( nCnt%512==0 ) term_Disp(tftp_pt, "#");
 			}
 			else if ( ++nRetry==5 ) break;
 		}
 		else if ( ++nRetry==5 ) break;
 	}
-	if ( nCnt>=512 ) term_Disp(pt, "\n");
+	if ( nCnt>=512 ) term_Disp(tftp_pt, "\n");
 }
 DWORD WINAPI tftpd(LPVOID p)
 {
@@ -1037,7 +1612,7 @@ DWORD WINAPI tftpd(LPVOID p)
 
 	char rootDir[MAX_PATH], fn[MAX_PATH];
 	strcpy( rootDir, (char *)p);
-	term_Print(pt,  "TFTPd started at %s\r\n", rootDir);
+	term_Print(tftp_pt,  "TFTPd started at %s\r\n", rootDir);
 	strcat(rootDir, "\\");
 
 	int ret;
@@ -1048,7 +1623,7 @@ DWORD WINAPI tftpd(LPVOID p)
 		connect(tftp_s1, (struct sockaddr *)&clientaddr, addrsize);
 		if ( dataBuf[1]==1  || dataBuf[1]==2 ) {
 			BOOL bRead = dataBuf[1]==1;
-			term_Print(pt, "TFTPd: %cRQ %s from %s\n", bRead?'R':'W',
+			term_Print(tftp_pt, "TFTPd: %cRQ %s from %s\n", bRead?'R':'W',
 							dataBuf+2, inet_ntoa(clientaddr.sin_addr));
 			strcpy(fn, rootDir);
 			strcat(fn, dataBuf+2);
@@ -1067,14 +1642,14 @@ DWORD WINAPI tftpd(LPVOID p)
 			}
 		}
 	}
-	term_Disp(pt,  ret==0 ? "TFTPD timed out\n" : "TFTPd stopped\n");
+	term_Disp(tftp_pt,  ret==0 ? "TFTPD timed out\n" : "TFTPd stopped\n");
 	closesocket( tftp_s1);
 	closesocket(tftp_s0);
 	tftp_s0 = INVALID_SOCKET;
 	tftpd_quit();
 	return 0;
 }
-BOOL tftp_Svr( char *root )
+BOOL tftp_Svr( TERM *pt, char *root )
 {
 	struct sockaddr_in svraddr;
 	int addrsize=sizeof(svraddr);
@@ -1087,7 +1662,8 @@ BOOL tftp_Svr( char *root )
 		}
 	}
 	else {
-		if ( is_directory(root) ) {
+		if ( is_directory(pt, root) ) {
+			tftp_pt = pt;
 			tftp_s0 = socket(AF_INET, SOCK_DGRAM, 0);
 			tftp_s1 = socket(AF_INET, SOCK_DGRAM, 0);
 			if ( tftp_s0==INVALID_SOCKET || tftp_s1==INVALID_SOCKET ) {
@@ -1104,7 +1680,9 @@ BOOL tftp_Svr( char *root )
 				if ( bind(tftp_s1, (struct sockaddr *)&svraddr,
 										addrsize)!=SOCKET_ERROR ) {
 					DWORD dwId;
-					CreateThread(NULL, 0, tftpd, (LPVOID)root, 0, &dwId);
+					if ( tftp_thread!=NULL ) CloseHandle(tftp_thread);
+					tftp_thread = CreateThread(NULL, 0, tftpd, (LPVOID)root,
+																0, &dwId);
 					return TRUE;
 				}
 			}
@@ -1113,4 +1691,11 @@ BOOL tftp_Svr( char *root )
 		}
 	}
 	return FALSE;
+}
+void tftp_Release(TERM *pt)		//pt is being freed, stop the TFTPd it started
+{
+	if ( tftp_pt!=pt ) return;
+	tftp_pt = sessions[0];
+	tftp_Svr(pt, NULL);
+	if ( tftp_thread!=NULL ) WaitForSingleObject(tftp_thread, 5000);
 }
\ No newline at end of file
@@ -22,7 +22,10 @@
 #include <time.h>
 #include <fcntl.h>
 #include <direct.h>
+#include <io.h>
+#include <sys/utime.h>
 #include <shlwapi.h>
+#include <bcrypt.h>
 int fnmatch(char *pattern, char *file, int flag)
 {
 	return PathMatchSpecA(file, pattern) ? 0 : 1;
@@ -99,15 +102,40 @@ int closedir(DIR *dir)
 	return 0;
 }
 /******************************************************************************/
+HANDLE mtx_xfer = NULL;				//scp transfer list mutex
+HANDLE xfer_done = NULL;			//set each time a batch leaves the list
+static HANDLE mtx_jump = NULL;		//one bastion lookup or open at a time
+static HANDLE mtx_known = NULL;		//known_hosts index and file
+void ssh2_Init()					//at startup, before any session thread
+{
+	mtx_jump = CreateMutex(NULL, FALSE, NULL);
+	mtx_known = CreateMutex(NULL, FALSE, NULL);
+	mtx_xfer = CreateMutex(NULL, FALSE, NULL);
+	xfer_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+}
 void ssh2_Construct(HOST *ph)
 {
 	ph->session = NULL;
 	ph->channel  =NULL;
 	ph->sftp = NULL;
+	ph->mtx_sftp = CreateMutex(NULL, FALSE, NULL);
+	ph->mtx_rdir = CreateMutex(NULL, FALSE, NULL);
+	ph->rdir_list = NULL;
+	ph->rdir_gen = ph->rdir_threads = 0;
+	ph->sftp_waiting = 0;
 	ph->bReturn = TRUE;
-	ph->mtx = CreateMutex(NULL, FALSE, L"channel mutex");
+	ph->bBatch = FALSE;
+	ph->mtx_job = CreateMutex(NULL, FALSE, NULL);	//per host, unnamed
+	ph->wake_s = INVALID_SOCKET;
+	ph->job_list = ph->job_run = NULL;
+	ph->klen = 0;
+	ph->poll_ms = 1000;
+	ph->bResize = ph->bClose = FALSE;
+	ph->sftp_window = 64;
+	ph->scp_jobs = 4;
+	ph->bVerify = FALSE;
 	ph->tunnel_list = NULL;
-	ph->mtx_tun = CreateMutex(NULL, FALSE, L"tunnel mutex");
+	ph->mtx_tun = CreateMutex(NULL, FALSE, NULL);
 	*ph->homedir = 0;
 	const char *home = getenv("USERPROFILE");
 	if ( home!=NULL ) {
@@ -115,20 +143,13 @@ void ssh2_Construct(HOST *ph)
 		strcat(ph->homedir, "/.ssh/");
 	}
 }
-int ssh_wait_socket(HOST *ph)
-{
-	TIMEVAL tv = {0, 100000};
-	fd_set fds, *rfd=NULL, *wfd=NULL;
-	FD_ZERO(&fds); FD_SET(ph->sock, &fds);
-	int dir = libssh2_session_block_directions(ph->session);
-	if ( dir==0 ) return 1;
-	if ( dir & LIBSSH2_SESSION_BLOCK_INBOUND ) rfd = &fds;
-	if ( dir & LIBSSH2_SESSION_BLOCK_OUTBOUND ) wfd = &fds;
-	return select(ph->sock+1, rfd, wfd, NULL, &tv);
-}
 char *ssh2_Gets(HOST *ph, char *prompt, BOOL bEcho)
 {
 	term_Disp(ph->term, prompt);
+	if ( ph->bBatch ) {					//fail now, don't hold up the jump
+		term_Disp(ph->term, "\r\n");
+		return NULL;
+	}
 	ph->bPassword=!bEcho;
 	ph->bReturn=FALSE;
 	ph->bGets=TRUE;
@@ -149,6 +170,221 @@ char *ssh2_Gets(HOST *ph, char *prompt, BOOL bEcho)
 	else
 		return NULL;
 }
+/**********************session owner thread****************************
+ * once connected, only the ssh() thread calls libssh2 on a session.
+ * other threads queue keystrokes and jobs, then wake it up, so typing
+ * is never stuck behind a transfer holding the session
+ */
+void ssh2_Wake(HOST *ph)
+{
+	if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+		if ( ph->wake_s!=INVALID_SOCKET ) send(ph->wake_s, "!", 1, 0);
+		ReleaseMutex(ph->mtx_job);
+	}
+}
+int ssh2_Job(HOST *ph, int (*step)(HOST *, struct Job *), void *ctx,
+															BOOL bWait)
+{
+	struct Job *job = (struct Job *)malloc(sizeof(struct Job));
+	if ( job==NULL ) return -1;
+	job->step = step;
+	job->ctx = ctx;
+	job->sock = INVALID_SOCKET;
+	job->events = POLLRDNORM;
+	job->revents = 0;
+	job->bCancel = FALSE;
+	job->rc = 0;
+	job->hDone = bWait ? CreateEvent(NULL, FALSE, FALSE, NULL) : NULL;
+	job->next = NULL;
+
+	BOOL bQueued = FALSE;
+	if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+		if ( ph->wake_s!=INVALID_SOCKET ) {		//owner thread is running
+			struct Job **pp = &ph->job_list;
+			while ( *pp!=NULL ) pp = &(*pp)->next;
+			*pp = job;
+			send(ph->wake_s, "!", 1, 0);
+			bQueued = TRUE;
+		}
+		ReleaseMutex(ph->mtx_job);
+	}
+	if ( !bQueued ) {
+		if ( job->hDone!=NULL ) CloseHandle(job->hDone);
+		free(job);
+		return -1;
+	}
+	if ( !bWait ) return 0;
+
+	WaitForSingleObject(job->hDone, INFINITE);
+	int rc = job->rc;
+	CloseHandle(job->hDone);
+	free(job);
+	return rc;
+}
+void job_done(struct Job *job)
+{
+	if ( job->hDone!=NULL )
+		SetEvent(job->hDone);				//waiter frees the job
+	else
+		free(job);
+}
+int ssh_pump(HOST *ph)		//one round of work, returns -1 when session ends
+{
+	int busy = 0;
+	if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+		if ( ph->klen>0 ) {					//keystrokes go first
+			int cch = libssh2_channel_write(ph->channel, ph->kbuf, ph->klen);
+			if ( cch>0 ) {
+				ph->klen -= cch;
+				memmove(ph->kbuf, ph->kbuf+cch, ph->klen);
+				busy++;
+			}
+			else if ( cch!=LIBSSH2_ERROR_EAGAIN )
+				ph->bClose = TRUE;
+		}
+		if ( ph->bResize ) {
+			if ( libssh2_channel_request_pty_size(ph->channel,
+					ph->size_w, ph->size_h)!=LIBSSH2_ERROR_EAGAIN )
+				ph->bResize = FALSE;
+		}
+		struct Job **pp = &ph->job_run;		//take over queued jobs
+		while ( *pp!=NULL ) pp = &(*pp)->next;
+		*pp = ph->job_list;
+		ph->job_list = NULL;
+		ReleaseMutex(ph->mtx_job);
+	}
+	if ( ph->bClose ) {
+		libssh2_channel_send_eof(ph->channel);
+		libssh2_session_disconnect(ph->session, "disconn");
+		return -1;
+	}
+
+	for ( int i=0; i<4; i++ ) {	//bounded, so jobs get their turn
+		char buf[32768];
+		int room = term_Room(ph->term);
+		if ( room==0 ) break;		//parser is behind, leave it in the window
+		int cch=libssh2_channel_read(ph->channel, buf, min(room, 32768));
+		if ( cch>0 ) {
+			term_Feed(ph->term, buf, cch, FALSE);
+			busy++;
+		}
+		else if ( cch==0 || cch==LIBSSH2_ERROR_EAGAIN )
+			break;
+		else
+			return -1;
+	}
+	if ( libssh2_channel_eof(ph->channel) ) return -1;
+
+	struct Job **pp = &ph->job_run;			//one step of each job
+	while ( *pp!=NULL ) {
+		struct Job *job = *pp;
+		int rc = job->step(ph, job);
+		job->revents = 0;
+		if ( rc==0 ) {
+			*pp = job->next;
+			job_done(job);
+			busy++;
+		}
+		else {
+			if ( rc>0 ) busy++;
+			pp = &job->next;
+		}
+	}
+	return busy;
+}
+//wait for the session, local sockets or wake up, fds grows with the jobs
+void ssh_poll(HOST *ph, WSAPOLLFD **pfds, int *pmax)
+{
+	struct Job *job;
+	int need = 2;
+	for ( job=ph->job_run; job!=NULL; job=job->next ) 
+		if ( job->sock!=INVALID_SOCKET ) need++;
+	if ( need>*pmax ) {
+		int newmax = max(need, *pmax*2);
+		WSAPOLLFD *p = (WSAPOLLFD *)realloc(*pfds, newmax*sizeof(WSAPOLLFD));
+		if ( p!=NULL ) {
+			*pfds = p;
+			*pmax = newmax;
+		}
+	}
+	if ( *pmax<2 ) {					//out of memory, look again soon
+		Sleep(10);
+		return;
+	}
+	WSAPOLLFD *fds = *pfds;
+	int cnt = 0;
+	fds[cnt].fd = ph->wake_s;
+	fds[cnt++].events = POLLRDNORM;
+
+	int dir = libssh2_session_block_directions(ph->session);
+	fds[cnt].fd = ph->sock;
+	fds[cnt].events = 0;
+	if ( dir & LIBSSH2_SESSION_BLOCK_INBOUND ) fds[cnt].events |= POLLRDNORM;
+	if ( dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) fds[cnt].events |= POLLWRNORM;
+	if ( fds[cnt].events==0 ) fds[cnt].events = POLLRDNORM;
+	//parser is behind and nobody else reads the session, the socket stays
+	//readable, so wait for host_Resume to wake us instead of spinning
+	if ( ph->job_run==NULL && term_Room(ph->term)==0 ) 
+		fds[cnt].events &= ~POLLRDNORM;
+	cnt++;
+
+	for ( job=ph->job_run; job!=NULL && cnt<*pmax; job=job->next ) {
+		if ( job->sock!=INVALID_SOCKET ) {
+			fds[cnt].fd = job->sock;
+			fds[cnt++].events = job->events;
+		}
+	}
+	int rc = WSAPoll(fds, cnt, ph->poll_ms);
+	ph->poll_ms = 1000;
+	if ( rc<=0 ) return;
+
+	if ( fds[0].revents!=0 ) {
+		char buf[256];
+		while ( recv(ph->wake_s, buf, sizeof(buf), 0)>0 );
+	}
+	int i = 2;
+	for ( job=ph->job_run; job!=NULL && i<cnt; job=job->next ) {
+		if ( job->sock!=INVALID_SOCKET ) job->revents = fds[i++].revents;
+	}
+}
+void ssh_owner(HOST *ph)
+{
+	SOCKET wake_s = wake_Socket();
+	if ( wake_s==INVALID_SOCKET ) return;
+	if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+		ph->wake_s = wake_s;
+		ReleaseMutex(ph->mtx_job);
+	}
+
+	int busy, poll_max = 256;
+	WSAPOLLFD *fds = (WSAPOLLFD *)malloc(poll_max*sizeof(WSAPOLLFD));
+	if ( fds==NULL ) poll_max = 0;
+	while ( (busy=ssh_pump(ph))>=0 ) {
+		if ( busy>0 ) ph->poll_ms = 0;	//still look, so tunnels get revents
+		ssh_poll(ph, &fds, &poll_max);
+	}
+	free(fds);
+
+	if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+		ph->wake_s = INVALID_SOCKET;		//no more keystrokes or jobs
+		struct Job **pp = &ph->job_run;
+		while ( *pp!=NULL ) pp = &(*pp)->next;
+		*pp = ph->job_list;
+		ph->job_list = NULL;
+		ph->klen = 0;
+		ReleaseMutex(ph->mtx_job);
+	}
+	closesocket(wake_s);
+	while ( ph->job_run!=NULL ) {			//cancel what's left
+		struct Job *job = ph->job_run;
+		ph->job_run = job->next;
+		job->bCancel = TRUE;
+		job->rc = -1;
+		job->step(ph, job);
+		job_done(job);
+	}
+}
+void rdir_Complete(HOST *ph);
 void ssh2_Send(HOST *ph, char *buf, int len)
 {
 	if ( !ph->bReturn ) {
@@ -156,6 +392,9 @@ void ssh2_Send(HOST *ph, char *buf, int len)
 		case '\015':ph->keys[ph->cursor]=0;
 					ph->bReturn=TRUE; 
 					break;
+		case '\t':	if ( ph->type==SFTP && !ph->bPassword ) 
+						rdir_Complete(ph);
+					break;
 		case '\010':
 		case '\177':if ( --ph->cursor<0 ) 
 					ph->cursor=0;
@@ -167,46 +406,57 @@ void ssh2_Send(HOST *ph, char *buf, int len)
 					if ( !ph->bPassword ) term_Parse(ph->term, p, 1);
 		}
 	}
-	else if ( ph->channel!=NULL ) {
-		int total=0, cch=0;
-		while ( total<len ) {
-			if ( WaitForSingleObject(ph->mtx, INFINITE)!=WAIT_OBJECT_0 ) break;
-			cch=libssh2_channel_write(ph->channel, buf+total, len-total);
-			ReleaseMutex(ph->mtx);
-			if ( cch>=0 )
-				total += cch;
-			else
-				if ( cch!=LIBSSH2_ERROR_EAGAIN || ssh_wait_socket(ph)<0 ) break;
+	else if ( ph->channel!=NULL ) {			//queue for the owner thread
+		while ( len>0 ) {
+			int cch = -1;
+			if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+				//before the owner starts keys wait in kbuf, its first
+				//pump sends them; once it has quit they are dropped
+				BOOL bOwner = ph->wake_s!=INVALID_SOCKET;
+				if ( bOwner || ph->status!=CONNECTED ) {
+					cch = min(len, (int)sizeof(ph->kbuf)-ph->klen);
+					memcpy(ph->kbuf+ph->klen, buf, cch);
+					ph->klen += cch;
+					if ( bOwner ) send(ph->wake_s, "!", 1, 0);
+					else if ( cch==0 ) cch = -1;
+				}
+				ReleaseMutex(ph->mtx_job);
+			}
+			if ( cch<0 ) break;
+			if ( cch==0 ) Sleep(1);			//queue is full on a long paste
+			buf += cch;
+			len -= cch;
 		}
 	}
 }
 void ssh2_Size(HOST *ph, int w, int h)
 {
-	if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-		if ( ph->channel!=NULL )
-			libssh2_channel_request_pty_size(ph->channel, w, h);
-		ReleaseMutex(ph->mtx);
+	if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+		ph->size_w = w;
+		ph->size_h = h;
+		ph->bResize = TRUE;
+		ReleaseMutex(ph->mtx_job);
 	}
+	ssh2_Wake(ph);
 }
 void ssh2_Close(HOST *ph )
 {
 	ph->bGets = FALSE;
-	if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-		if ( ph->channel!=NULL )
-			libssh2_channel_send_eof(ph->channel);
-		if ( ph->session!=NULL )
-			libssh2_session_disconnect(ph->session, "disconn");
-		ReleaseMutex(ph->mtx);
+	if ( WaitForSingleObject(ph->mtx_job, INFINITE)==WAIT_OBJECT_0 ) {
+		ph->bClose = TRUE;
+		ReleaseMutex(ph->mtx_job);
 	}
+	ssh2_Wake(ph);
 }
 
 void tun_closeall(HOST *ph);
+int ssh_jump(HOST *ph);
 const char *keytypes[]={"unknown", "rsa", "dss", "ecdsa256", 
 							"ecdsa384", "ecdsa521", "ed25519"};
 int ssh_parameters(  HOST *ph, char *p )
 {
 	ph->username = ph->password = ph->passphrase = NULL;
-	ph->hostname = ph->subsystem = NULL;
+	ph->hostname = ph->subsystem = ph->jumphost = NULL;
 	while ( (p!=NULL) && (*p!=0) ) {
 		while ( *p==' ' ) p++;
 		if ( *p=='-' ) {
@@ -217,6 +467,7 @@ int ssh_parameters(  HOST *ph, char *p )
 					  break;
 			case 'P': p+=3; ph->port = atoi(p); break;
 			case 's': p+=3; ph->subsystem = p; break;
+			case 'J': p+=3; ph->jumphost = p; break;
 			}
 			p = strchr( p, ' ');
 			if ( p!=NULL ) *p++ = 0;
@@ -246,6 +497,239 @@ int ssh_parameters(  HOST *ph, char *p )
 	}
 	return 0;
 }
+/*****************************known_hosts*****************************/
+#define KNOWN_SLOTS 4096			//hash buckets, power of 2
+struct known {						//plain known_hosts entry, one per name
+	struct known *next;
+	char *host;
+	unsigned char *key;				//raw key blob, starts with its type
+	int len;
+};
+static struct known *known_index[KNOWN_SLOTS];
+static char known_file[MAX_PATH];
+static time_t known_mtime = 0;
+static long long known_size = -1;
+static int known_hashed = 0;		//|1| entries, only libssh2 can check them
+unsigned known_Hash(const char *host)
+{
+	unsigned h = 2166136261u;		//FNV-1a, case insensitive
+	for ( ; *host; host++ ) {
+		unsigned char c = *host;
+		if ( c>='A' && c<='Z' ) c += 32;
+		h = (h^c)*16777619u;
+	}
+	return h&(KNOWN_SLOTS-1);
+}
+const char *b64 = 
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+int b64_decode(const char *in, unsigned char *out)//stops at the first non b64
+{
+	int len = 0, bits = 0, n = 0;
+	const char *p;
+	while ( *in && *in!='=' && (p=strchr(b64, *in))!=NULL ) {
+		bits = ((bits<<6)|(int)(p-b64))&0xffff;
+		n += 6;
+		if ( n>=8 ) {
+			n -= 8;
+			out[len++] = (bits>>n)&0xff;
+		}
+		in++;
+	}
+	return len;
+}
+int b64_encode(const unsigned char *in, int len, char *out)
+{
+	int i, j = 0;
+	for ( i=0; i+2<len; i+=3 ) {
+		out[j++] = b64[in[i]>>2];
+		out[j++] = b64[((in[i]&3)<<4)|(in[i+1]>>4)];
+		out[j++] = b64[((in[i+1]&15)<<2)|(in[i+2]>>6)];
+		out[j++] = b64[in[i+2]&63];
+	}
+	if ( i<len ) {
+		out[j++] = b64[in[i]>>2];
+		if ( i+1<len ) {
+			out[j++] = b64[((in[i]&3)<<4)|(in[i+1]>>4)];
+			out[j++] = b64[(in[i+1]&15)<<2];
+		}
+		else {
+			out[j++] = b64[(in[i]&3)<<4];
+			out[j++] = '=';
+		}
+		out[j++] = '=';
+	}
+	out[j] = 0;
+	return j;
+}
+int key_Type(const unsigned char *key, int len, const char **type)
+{
+	if ( len<4 ) return 0;
+	int n = (key[0]<<24)|(key[1]<<16)|(key[2]<<8)|key[3];
+	if ( n<=0 || n>len-4 ) return 0;
+	*type = (const char *)key+4;
+	return n;
+}
+void known_Free()
+{
+	for ( int i=0; i<KNOWN_SLOTS; i++ ) {
+		while ( known_index[i]!=NULL ) {
+			struct known *k = known_index[i];
+			known_index[i] = k->next;
+			free(k);
+		}
+	}
+	known_hashed = 0;
+}
+void known_Load(const char *file)		//holding mtx_known
+{
+	known_Free();
+	strcpy(known_file, file);
+	struct stat sb;
+	known_mtime = 0;
+	known_size = -1;
+	if ( stat(file, &sb)==0 ) {
+		known_mtime = sb.st_mtime;
+		known_size = sb.st_size;
+	}
+	FILE *fp = fopen(file, "rb");
+	if ( fp==NULL ) return;
+	char line[8192];
+	unsigned char key[6144];
+	while ( fgets(line, sizeof(line), fp)!=NULL ) {
+		char *hosts = line;
+		while ( *hosts==' ' || *hosts=='\t' ) hosts++;
+		if ( *hosts=='#' || *hosts=='@' || *hosts<' ' ) continue;
+		if ( *hosts=='|' ) {
+			known_hashed++;
+			continue;
+		}
+		char *type = strchr(hosts, ' ');
+		if ( type==NULL ) continue;
+		*type++ = 0;
+		char *data = strchr(type, ' ');
+		if ( data==NULL ) continue;
+		int len = b64_decode(data+1, key);
+		if ( len==0 ) continue;
+
+		for ( char *host=strtok(hosts, ","); host!=NULL; 
+												host=strtok(NULL, ",") ) {
+			if ( strpbrk(host, "*?!")!=NULL ) continue;	//patterns
+			int hlen = strlen(host);
+			struct known *k = (struct known *)malloc(sizeof(struct known)
+															+hlen+1+len);
+			if ( k==NULL ) break;
+			k->host = (char *)(k+1);
+			strcpy(k->host, host);
+			k->key = (unsigned char *)k->host+hlen+1;
+			memcpy(k->key, key, len);
+			k->len = len;
+			unsigned h = known_Hash(host);
+			k->next = known_index[h];
+			known_index[h] = k;
+		}
+	}
+	fclose(fp);
+}
+int known_Check(HOST *ph, const char *file, const char *name, 
+										const char *key, size_t len)
+{
+	int check = LIBSSH2_KNOWNHOST_CHECK_NOTFOUND;
+	if ( WaitForSingleObject(mtx_known, INFINITE)!=WAIT_OBJECT_0 ) 
+		return LIBSSH2_KNOWNHOST_CHECK_FAILURE;
+
+	struct stat sb;						//reload only when the file changed
+	if ( strcmp(file, known_file)!=0 || stat(file, &sb)!=0 
+		|| sb.st_mtime!=known_mtime || sb.st_size!=known_size ) 
+		known_Load(file);
+
+	const char *type, *ktype;
+	int tlen = key_Type((const unsigned char *)key, len, &type);
+	for ( struct known *k=known_index[known_Hash(name)]; k!=NULL; 
+															k=k->next ) {
+		if ( stricmp(k->host, name)!=0 ) continue;
+		if ( k->len==(int)len && memcmp(k->key, key, len)==0 ) {
+			check = LIBSSH2_KNOWNHOST_CHECK_MATCH;
+			break;
+		}
+		if ( tlen>0 && key_Type(k->key, k->len, &ktype)==tlen 
+					&& memcmp(type, ktype, tlen)==0 )
+			check = LIBSSH2_KNOWNHOST_CHECK_MISMATCH;
+	}
+
+	//hashed names can't be indexed, let libssh2 go through the file
+	if ( check==LIBSSH2_KNOWNHOST_CHECK_NOTFOUND && known_hashed>0 ) {
+		LIBSSH2_KNOWNHOSTS *nh = libssh2_knownhost_init(ph->session);
+		if ( nh!=NULL ) {
+			struct libssh2_knownhost *knownhost;
+			size_t klen;
+			int keytype = 0;
+			libssh2_session_hostkey(ph->session, &klen, &keytype);
+			if ( keytype>0 ) keytype++;
+			if ( libssh2_knownhost_readfile(nh, file, 
+									LIBSSH2_KNOWNHOST_FILE_OPENSSH)>=0 ) {
+				int rc = libssh2_knownhost_check(nh, name, key, len,
+									LIBSSH2_KNOWNHOST_TYPE_PLAIN|
+									LIBSSH2_KNOWNHOST_KEYENC_RAW, &knownhost);
+				if ( rc==LIBSSH2_KNOWNHOST_CHECK_MATCH ) check = rc;
+				if ( rc==LIBSSH2_KNOWNHOST_CHECK_MISMATCH && keytype==
+							(int)((knownhost->typemask&LIBSSH2_KNOWNHOST_KEY_MASK)
+										>>LIBSSH2_KNOWNHOST_KEY_SHIFT) ) 
+					check = rc;
+			}
+			libssh2_knownhost_free(nh);
+		}
+	}
+	ReleaseMutex(mtx_known);
+	return check;
+}
+//copy known_hosts to a temp file, less the old key of name if bReplace,
+//add the new key and rename over the original
+int known_Add(const char *file, const char *name, const char *key, 
+											size_t len, BOOL bReplace)
+{
+	const char *type;
+	int tlen = key_Type((const unsigned char *)key, len, &type);
+	char *line = (char *)malloc(8192+len*2);
+	if ( tlen==0 || line==NULL ) {
+		free(line);
+		return -1;
+	}
+	int rc = -1;
+	if ( WaitForSingleObject(mtx_known, INFINITE)==WAIT_OBJECT_0 ) {
+		char tmpfile[MAX_PATH+8];
+		sprintf(tmpfile, "%s.tmp", file);
+		FILE *fout = fopen(tmpfile, "wb");
+		if ( fout!=NULL ) {
+			FILE *fin = fopen(file, "rb");
+			int nlen = strlen(name), last = '\n';
+			if ( fin!=NULL ) {
+				while ( fgets(line, 8192, fin)!=NULL ) {
+					int cnt = strlen(line);
+					if ( bReplace && strnicmp(line, name, nlen)==0 
+						&& line[nlen]==' ' && strncmp(line+nlen+1, type, tlen)==0 
+						&& line[nlen+1+tlen]==' ' ) continue;
+					fwrite(line, 1, cnt, fout);
+					last = line[cnt-1];
+				}
+				fclose(fin);
+			}
+			if ( last!='\n' ) fputc('\n', fout);
+			int i = sprintf(line, "%s %.*s ", name, tlen, type);
+			i += b64_encode((const unsigned char *)key, len, line+i);
+			strcpy(line+i, " **tinyTerm**\n");
+			fputs(line, fout);
+			if ( fclose(fout)==0 && MoveFileExA(tmpfile, file,
+							MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH) )
+				rc = 0;
+			else
+				DeleteFileA(tmpfile);
+		}
+		known_Load(file);
+		ReleaseMutex(mtx_known);
+	}
+	free(line);
+	return rc;
+}
 int ssh_knownhost(HOST *ph)
 {
 	int rc = -4;
@@ -265,7 +749,6 @@ int ssh_knownhost(HOST *ph)
 		return rc;
 	}
 	buff_len=sprintf(keybuf, "%s key fingerprint", keytypes[type]);
-	if ( type>0 ) type++;
 
 	const char *fingerprint;
 	fingerprint = libssh2_hostkey_hash(ph->session, LIBSSH2_HOSTKEY_HASH_SHA1);
@@ -273,39 +756,42 @@ int ssh_knownhost(HOST *ph)
 		sprintf(keybuf+buff_len+i*3, ":%02x", (unsigned char)fingerprint[i]);
 	}
 
-	LIBSSH2_KNOWNHOSTS *nh = libssh2_knownhost_init(ph->session);
-	if ( nh==NULL ) {
-		term_Disp(ph->term, "known_hosts init");
-		return rc;
+	//openssh keeps non-standard ports as [host]:port, older entries
+	//added by tinyTerm have the plain hostname
+	char name[300];
+	if ( ph->port==22 ) 
+		snprintf(name, sizeof(name), "%s", ph->hostname);
+	else
+		snprintf(name, sizeof(name), "[%s]:%d", ph->hostname, ph->port);
+	check = known_Check(ph, knownhostfile, name, key, len);
+	if ( check==LIBSSH2_KNOWNHOST_CHECK_NOTFOUND && ph->port!=22 ) {
+		//plain hostname only vouches for a key, another key there may
+		//just be the server on port 22, so [host]:port stays not found
+		if ( known_Check(ph, knownhostfile, ph->hostname, key, len)
+								==LIBSSH2_KNOWNHOST_CHECK_MATCH ) 
+			check = LIBSSH2_KNOWNHOST_CHECK_MATCH;
 	}
-	if ( libssh2_knownhost_readfile(nh, knownhostfile,
-							   LIBSSH2_KNOWNHOST_FILE_OPENSSH)<0 ) {
+	if ( check==LIBSSH2_KNOWNHOST_CHECK_FAILURE ) {
 		term_Disp(ph->term, "known_hosts read");
 		return rc;
-	};
-	struct libssh2_knownhost *knownhost;
-	check = libssh2_knownhost_check(nh, ph->hostname, key, len,
-								LIBSSH2_KNOWNHOST_TYPE_PLAIN|
-								LIBSSH2_KNOWNHOST_KEYENC_RAW, &knownhost);
+	}
 	char *p = NULL;
+	BOOL bReplace = FALSE;
 	const char *msg = "Disconnected!";
 	switch ( check ) {
 	case LIBSSH2_KNOWNHOST_CHECK_MATCH: rc=0; msg=""; break;
-	case LIBSSH2_KNOWNHOST_CHECK_MISMATCH:
-		if ( type==((knownhost->typemask&LIBSSH2_KNOWNHOST_KEY_MASK)
-								  >>LIBSSH2_KNOWNHOST_KEY_SHIFT) ) {
-			term_Print(ph->term, "%s\r\n\033[31m!!!hostkey changed!!!\r\n",
-																	keybuf);
-			p=ssh2_Gets(ph, "Update hostkey and continue?(Yes/No):", TRUE);
-			if ( p==NULL ) {
-				term_Print(ph->term, "\r\n");
-				break;
-			}
-			if ( *p!='y' && *p!='Y' ) break;
-			libssh2_knownhost_del(nh, knownhost);//delete old hostkey
-			msg = "\033[32mhostkey updated";
+	case LIBSSH2_KNOWNHOST_CHECK_MISMATCH:	//same key type, different key
+		term_Print(ph->term, "%s\r\n\033[31m!!!hostkey changed!!!\r\n",
+																keybuf);
+		p=ssh2_Gets(ph, "Update hostkey and continue?(Yes/No):", TRUE);
+		if ( p==NULL ) {
+			term_Print(ph->term, "\r\n");
+			break;
 		}
-		//fall through if hostkey type different, or to update hostkey
+		if ( *p!='y' && *p!='Y' ) break;
+		bReplace = TRUE;					//delete old hostkey
+		msg = "\033[32mhostkey updated";
+		//fall through to add the new hostkey
 	case LIBSSH2_KNOWNHOST_CHECK_NOTFOUND:
 		if ( p == NULL ) {
 			term_Print(ph->term, "%s\r\n\033[33mhostkey unknown!", keybuf);
@@ -317,21 +803,13 @@ int ssh_knownhost(HOST *ph)
 		}
 		if ( *p!='y' && *p!='Y' ) break;
 		rc = 0;
-		libssh2_knownhost_addc(nh, ph->hostname, "", key, 
-									len,"**tinyTerm**", 12,
-									LIBSSH2_KNOWNHOST_TYPE_PLAIN|
-									LIBSSH2_KNOWNHOST_KEYENC_RAW|
-									(type<<LIBSSH2_KNOWNHOST_KEY_SHIFT), 
-									&knownhost);
-		if ( libssh2_knownhost_writefile(nh, knownhostfile,
-									LIBSSH2_KNOWNHOST_FILE_OPENSSH)==0 ) {
+		if ( known_Add(knownhostfile, name, key, len, bReplace)==0 ) {
 			if ( *msg=='D' ) msg = "\033[32mhostkey added";
 		}
 		else
 			msg = "\033[33mfailed to update hostkey file";
 	}
 	term_Print(ph->term, "%s\r\n", msg);
-	libssh2_knownhost_free(nh);
 	return rc;
 }
 static void kbd_callback(const char *name, int name_len,
@@ -341,10 +819,11 @@ static void kbd_callback(const char *name, int name_len,
                          LIBSSH2_USERAUTH_KBDINT_RESPONSE *responses,
                          void **abstract)
 {
+	HOST *ph = (HOST *)(*abstract);	//set by libssh2_session_init_ex
   for ( int i=0; i<num_prompts; i++) {
 		char *prompt = strdup(prompts[i].text);
 		prompt[prompts[i].length] = 0;
-		const char *p = tiny_Gets(prompt, prompts[i].echo);
+		const char *p = ssh2_Gets(ph, prompt, prompts[i].echo);
 		free(prompt);
 		if ( p!=NULL ) {
 			responses[i].text = strdup(p);
@@ -427,10 +906,12 @@ DWORD WINAPI ssh(void *pv)
 
 	ph->type = (ph->subsystem==NULL ) ? SSH : NETCONF;
 	ph->status=CONNECTING;
+	ph->bClose = FALSE;
 	term_Title(ph->term, ph->hostname);
-	if ( host_tcp(ph)==-1 ) goto TCP_Close;
+	if ( (ph->jumphost!=NULL ? ssh_jump(ph) : host_tcp(ph))==-1 ) 
+		goto TCP_Close;
 
-	ph->session = libssh2_session_init();
+	ph->session = libssh2_session_init_ex(NULL, NULL, NULL, ph);
 	if ( ph->session!=NULL ) {
 		while ( (rc=libssh2_session_handshake(ph->session, ph->sock))
 				==LIBSSH2_ERROR_EAGAIN );
@@ -481,41 +962,19 @@ DWORD WINAPI ssh(void *pv)
 
 	ph->status=CONNECTED;
 	term_Title(ph->term, ph->hostname);
-	while ( libssh2_channel_eof(ph->channel)==0 ) {
-		char buf[32768];
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			int cch=libssh2_channel_read(ph->channel, buf, 32768);
-			ReleaseMutex(ph->mtx);
-			if ( cch >= 0 ) {
-				if ( ph->subsystem==NULL ) 
-					term_Parse(ph->term, buf, cch);
-				else
-					term_Parse_XML(ph->term, buf, cch);
-			}
-			else {
-				if ( cch!=LIBSSH2_ERROR_EAGAIN || ssh_wait_socket( ph )<0 ) 
-					break;
-			}
-		}
-	}
+	ssh_owner(ph);							//until the channel is closed
 	tun_closeall( ph);
 	ph->type = NONE;
 	term_Error(ph->term, "Disconnected");
 
 Channel_Close:
 	if ( ph->channel!=NULL ) {
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			libssh2_channel_close(ph->channel);
-			ReleaseMutex(ph->mtx);
-		}
+		libssh2_channel_close(ph->channel);
 		ph->channel = NULL;
 	}
 Session_Close:
 	if ( ph->session!=NULL ) {
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			libssh2_session_free(ph->session);
-			ReleaseMutex(ph->mtx);
-		}
+		libssh2_session_free(ph->session);
 		ph->session = NULL;
 	}
 	closesocket(ph->sock);
@@ -526,220 +985,1040 @@ TCP_Close:
 	term_Title(ph->term, "");
 	return 1;
 }
-void print_total(TERM *pt, time_t start, long total)
-{
-	double duration = difftime(time(NULL), start);
-	term_Print(pt, "\033[12D%ld bytes", total);
-	if ( duration>0 ) 
-		term_Print(pt, ", %dMB/s", (int)((total>>20)/duration));
-}
-int scp_read_one(HOST *ph, const char *rpath, const char *lpath)
+struct exec_job {					//command run on an exec channel
+	const char *cmd;
+	LIBSSH2_CHANNEL *channel;
+	char *out;
+	int size, len;
+	int state;
+};
+int exec_step(HOST *ph, struct Job *job)
 {
-	LIBSSH2_CHANNEL *scp_channel;
-	libssh2_struct_stat fileinfo;
-	term_Print(ph->term, "\r\n\033[32mscp: %s\t\t\t", lpath);
-	int err_no=0;
-	do {
-		WaitForSingleObject(ph->mtx, INFINITE);
-		scp_channel = libssh2_scp_recv2(ph->session, rpath, &fileinfo);
-		if ( !scp_channel ) err_no = libssh2_session_last_errno(ph->session);
-		ReleaseMutex(ph->mtx);
-		if (!scp_channel) {
-			if ( err_no!=LIBSSH2_ERROR_EAGAIN || ssh_wait_socket(ph)<0 ) {
-				term_Print(ph->term,"\033[31mcouldn't open remote file");
-				return -1;
-			}
-		}
-	} while (!scp_channel);
-
-	FILE *fp = fopen_utf8(lpath, "wb");
-	if ( fp==NULL ) {
-		term_Print(ph->term, "\033[31mcouldn't write to local file");
-		goto Close;
+	struct exec_job *ex = (struct exec_job *)job->ctx;
+	if ( job->bCancel ) {
+		if ( ex->channel!=NULL ) libssh2_channel_free(ex->channel);
+		ex->channel = NULL;
+		return 0;
 	}
-
-	int blocks = 0;
-	time_t start = time(NULL);
-	libssh2_struct_stat_size total = 0;
-	libssh2_struct_stat_size fsize = fileinfo.st_size;
-	while  ( total<fsize ) {
-		char mem[1024*32];
-		int amount=sizeof(mem);
-		if ( (fsize-total) < amount) {
-			amount = (int)(fsize-total);
-		}
-		int rc = 0;
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			rc = libssh2_channel_read(scp_channel, mem, amount);
-			ReleaseMutex(ph->mtx);
-		}
-		if ( rc==0 ) continue;
-		if ( rc>0) {
-			int nwrite = fwrite(mem, 1, rc, fp);
-			if ( nwrite>0 ) {
-				total += nwrite;
-				if ( ++blocks==32 ) {
-					blocks = 0;
-					term_Print(ph->term, "\033[12D% 10lldKB", total>>10);
-				}
-			}
-			if ( nwrite!=rc ) {
-				term_Print(ph->term, ", \033[31merror writing to file");
-				break;
-			}
+	int rc = 0;
+	switch ( ex->state ) {
+	case 0:
+		ex->channel = libssh2_channel_open_session(ph->session);
+		if ( ex->channel==NULL ) {
+			rc = libssh2_session_last_errno(ph->session);
+			if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+			job->rc = -1;
+			return 0;
 		}
-		else {
-			if ( rc!=LIBSSH2_ERROR_EAGAIN || ssh_wait_socket(ph)<0 ) {
-				term_Print(ph->term, ", \033[31merror reading from host");
-				break;
-			}
+		break;
+	case 1:
+		rc = libssh2_channel_exec(ex->channel, ex->cmd);
+		if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+		if ( rc<0 ) {
+			job->rc = -1;
+			ex->state = 3;
+			return 1;
+		}
+		break;
+	case 2:
+		rc = libssh2_channel_read(ex->channel, ex->out+ex->len,
+										ex->size-1-ex->len);
+		if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+		if ( rc>0 ) {
+			ex->len += rc;
+			if ( ex->len<ex->size-1 ) return 1;
 		}
+		break;
+	default:
+		rc = libssh2_channel_close(ex->channel);
+		if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+		rc = libssh2_channel_free(ex->channel);
+		if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+		ex->channel = NULL;
+		if ( job->rc==0 ) job->rc = ex->len;
+		return 0;
 	}
-	fclose(fp);
-	if ( total==fsize ) print_total(ph->term, start, total);
-	
-Close:
-	if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-		libssh2_channel_close(scp_channel);
-		libssh2_channel_free(scp_channel);
-		ReleaseMutex(ph->mtx);
+	ex->state++;
+	return 1;
+}
+//run cmd on a new channel of the session, out gets stdout up to size-1
+//bytes, returns the length or -1, called from threads other than owner
+int ssh2_Exec(HOST *ph, const char *cmd, char *out, int size)
+{
+	struct exec_job ex;
+	memset(&ex, 0, sizeof(ex));
+	ex.cmd = cmd;
+	ex.out = out;
+	ex.size = size;
+	*out = 0;
+	int rc = ssh2_Job(ph, exec_step, &ex, TRUE);
+	out[ex.len] = 0;
+	return rc;
+}
+struct sha256 {						//bcrypt SHA-256 hash
+	BCRYPT_ALG_HANDLE hAlg;
+	BCRYPT_HASH_HANDLE hHash;
+	UCHAR obj[1024];
+};
+BOOL sha256_Open(struct sha256 *h)
+{
+	DWORD len, cb;
+	h->hHash = NULL;
+	if ( !BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&h->hAlg,
+									BCRYPT_SHA256_ALGORITHM, NULL, 0)) ) {
+		h->hAlg = NULL;
+		return FALSE;
+	}
+	if ( BCRYPT_SUCCESS(BCryptGetProperty(h->hAlg, BCRYPT_OBJECT_LENGTH,
+						(PUCHAR)&len, sizeof(len), &cb, 0))
+	  && len<=sizeof(h->obj)
+	  && BCRYPT_SUCCESS(BCryptCreateHash(h->hAlg, &h->hHash, h->obj, len,
+														NULL, 0, 0)) )
+		return TRUE;
+	BCryptCloseAlgorithmProvider(h->hAlg, 0);
+	h->hAlg = NULL;
+	h->hHash = NULL;
+	return FALSE;
+}
+void sha256_Data(struct sha256 *h, const char *buf, size_t len)
+{
+	if ( h->hHash!=NULL )
+		BCryptHashData(h->hHash, (PUCHAR)buf, (ULONG)len, 0);
+}
+void sha256_Close(struct sha256 *h, char *hex)	//hex is 65 bytes, "" if failed
+{
+	*hex = 0;
+	if ( h->hHash==NULL ) return;
+	UCHAR digest[32];
+	if ( BCRYPT_SUCCESS(BCryptFinishHash(h->hHash, digest, 32, 0)) )
+		for ( int i=0; i<32; i++ ) sprintf(hex+i*2, "%02x", digest[i]);
+	BCryptDestroyHash(h->hHash);
+	BCryptCloseAlgorithmProvider(h->hAlg, 0);
+	h->hHash = NULL;
+	h->hAlg = NULL;
+}
+struct file_hash {					//sha-256 of a local file, on its own thread
+	char path[MAX_PATH*3];
+	char hex[65];
+	HANDLE hThread;
+};
+DWORD WINAPI hash_thread(void *pv)
+{
+	struct file_hash *fh = (struct file_hash *)pv;
+	struct sha256 h;
+	FILE *fp = fopen_utf8(fh->path, "rbS");
+	if ( fp==NULL ) return 1;
+	char *mem = (char *)malloc(1024*256);
+	if ( mem!=NULL && sha256_Open(&h) ) {
+		size_t len;
+		while ( (len=fread(mem, 1, 1024*256, fp))>0 ) sha256_Data(&h, mem, len);
+		BOOL bError = ferror(fp);
+		sha256_Close(&h, fh->hex);
+		if ( bError ) *fh->hex = 0;
 	}
+	free(mem);
+	fclose(fp);
 	return 0;
 }
-int scp_write_one(HOST *ph, const char *lpath, const char *rpath)
+struct file_hash *hash_Start(const char *path)
 {
-	LIBSSH2_CHANNEL *scp_channel;
-	struct _stat fileinfo;
-	term_Print(ph->term, "\r\n\033[32mscp: %s\t\t\t", rpath);
-	FILE *fp =fopen_utf8(lpath, "rb");
-	if ( !fp ) {
-		term_Print(ph->term, "\033[31mcouldn't read local file");
-		return -1;
+	struct file_hash *fh = (struct file_hash *)malloc(sizeof(struct file_hash));
+	if ( fh==NULL ) return NULL;
+	strncpy(fh->path, path, sizeof(fh->path)-1);
+	fh->path[sizeof(fh->path)-1] = 0;
+	*fh->hex = 0;
+	fh->hThread = CreateThread(NULL, 0, hash_thread, fh, 0, NULL);
+	if ( fh->hThread==NULL ) hash_thread(fh);
+	return fh;
+}
+char *hash_Wait(struct file_hash *fh)	//hex digest, "" if file unreadable
+{
+	if ( fh->hThread!=NULL ) {
+		WaitForSingleObject(fh->hThread, INFINITE);
+		CloseHandle(fh->hThread);
+		fh->hThread = NULL;
 	}
-	stat_utf8(lpath, &fileinfo);
-
-	int err_no = 0;
-	do {
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			scp_channel = libssh2_scp_send(ph->session, rpath,
-						fileinfo.st_mode&0777, (unsigned long)fileinfo.st_size);
-			if ( !scp_channel ) err_no = libssh2_session_last_errno(ph->session);
-			ReleaseMutex(ph->mtx);
-		}
-		if ( !scp_channel ) {
-			if ( err_no!=LIBSSH2_ERROR_EAGAIN || ssh_wait_socket(ph)<0 ) {
-				term_Print(ph->term, "\033[31mcouldn't create remote file");
-				fclose(fp);
-				return -2;
-			}
-		}
-	} while ( !scp_channel);
-
-	char mem[1024*32];
-	time_t start=time(NULL);
-	size_t nread=0;
-	long total=0;
-	int blocks=0;
-	while ( (nread=fread(mem, 1, sizeof(mem), fp)) >0 ) {
-		char *ptr = mem;
-		int rc = 0;
-		while ( nread>0 ) {
-			if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-				rc = libssh2_channel_write(scp_channel, ptr, nread);
-				ReleaseMutex(ph->mtx);
-			}
-			if ( rc>0 ) {
-				ptr += rc;
-				nread -= rc;
-				total += rc;
-			}
-			else {
-				if ( rc!=LIBSSH2_ERROR_EAGAIN || ssh_wait_socket(ph)<0 ) break;
-			}
-		}
-		if ( rc>0 ) {
-			if ( ++blocks==32 ) {
-				blocks = 0;
-				term_Print(ph->term, "\033[12D% 10ldKB", total>>10);
-			}
-		}
-		else {
-			term_Print(ph->term, ", \033[31merror writing to host");
-			break;
-		}
+	return fh->hex;
+}
+//quote a remote path for the shell, keeping a leading ~/ expandable
+int sh_quote(char *out, const char *path)
+{
+	char *p = out;
+	if ( path[0]=='~' && (path[1]=='/' || path[1]==0) ) {
+		*p++ = *path++;
+		if ( *path ) *p++ = *path++;
 	}
-	if ( nread==0 ) //end of file
-		print_total(ph->term, start, total);
-	fclose(fp);
-
-	int rc;
-	do {
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			rc = libssh2_channel_send_eof(scp_channel);
-			ReleaseMutex(ph->mtx);
+	*p++ = '\'';
+	for ( ; *path; path++ ) {
+		if ( *path=='\'' ) {
+			strcpy(p, "'\\''");
+			p += 4;
 		}
-	} while (rc==LIBSSH2_ERROR_EAGAIN);
-	do {
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			rc = libssh2_channel_wait_eof(scp_channel);
-			ReleaseMutex(ph->mtx);
-		}
-	} while (rc==LIBSSH2_ERROR_EAGAIN);
-	do {
-		if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-			rc = libssh2_channel_wait_closed(scp_channel);
-			ReleaseMutex(ph->mtx);
+		else
+			*p++ = *path;
+	}
+	*p++ = '\'';
+	*p = 0;
+	return p-out;
+}
+#define WRITER_SIZE 1024*256
+struct disk_writer {				//file writes overlapped with network reads
+	FILE *fp;
+	char *mem[2];
+	size_t len[2];
+	int fill;						//buffer being filled by network side
+	HANDLE hThread, hWork, hIdle;
+	BOOL bQuit, bError;
+	volatile BOOL bBusy;			//writer thread has a buffer to write
+	DWORD start, disk_ms, wait_ms;	//wait_ms is time stalled on the disk
+	DWORD stall;					//writer_Ready said no since then
+	BOOL bHash;						//hash data on the writer thread
+	struct sha256 sha;
+	char hex[65];					//set by writer_Close if bHash
+};
+DWORD WINAPI writer_thread(void *pv)
+{
+	struct disk_writer *w = (struct disk_writer *)pv;
+	while ( WaitForSingleObject(w->hWork, INFINITE)==WAIT_OBJECT_0 ) {
+		int i = w->fill^1;
+		if ( w->len[i]>0 ) {
+			if ( w->bHash ) sha256_Data(&w->sha, w->mem[i], w->len[i]);
+			DWORD t = GetTickCount();
+			if ( fwrite(w->mem[i], 1, w->len[i], w->fp)!=w->len[i] )
+				w->bError = TRUE;
+			w->disk_ms += GetTickCount()-t;
+			w->len[i] = 0;
 		}
-	} while (rc==LIBSSH2_ERROR_EAGAIN);
-	if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-		libssh2_channel_close(scp_channel);
-		libssh2_channel_free(scp_channel);
-		ReleaseMutex(ph->mtx);
+		BOOL bQuit = w->bQuit;
+		w->bBusy = FALSE;
+		SetEvent(w->hIdle);
+		if ( bQuit ) break;
 	}
 	return 0;
 }
-void scp_read(HOST *ph, char *lpath, char *rfiles)
+//size is the expected file size, preallocated so the file doesn't grow
+//one write at a time, and cut back to what was written at writer_Close.
+//0 for files that may be resumed, a crash would leave the full size
+BOOL writer_Open(struct disk_writer *w, FILE *fp, long long size, BOOL bHash)
 {
-	char lfile[4096];
-	strncpy(lfile, lpath, 1024);
-	lfile[1024] = 0;
+	memset(w, 0, sizeof(struct disk_writer));
+	w->mem[0] = (char *)malloc(WRITER_SIZE*2);
+	if ( w->mem[0]==NULL ) return FALSE;
+	w->bHash = bHash && sha256_Open(&w->sha);
+	w->mem[1] = w->mem[0]+WRITER_SIZE;
+	w->fp = fp;
+	w->start = GetTickCount();
 
-	struct _stat statbuf;
-	if ( stat_utf8(lpath, &statbuf)!=-1 ) {
-		if ( (statbuf.st_mode & S_IFMT) == S_IFDIR ) 
-			strcat(lfile, "/");
+	long long pos = _ftelli64(fp);
+	if ( size>pos ) {
+		HANDLE h = (HANDLE)_get_osfhandle(_fileno(fp));
+		LARGE_INTEGER li;
+		li.QuadPart = size;
+		if ( SetFilePointerEx(h, li, NULL, FILE_BEGIN) ) SetEndOfFile(h);
+		li.QuadPart = pos;
+		SetFilePointerEx(h, li, NULL, FILE_BEGIN);
 	}
-	char *ldir = lfile+strlen(lfile);
-
-	char *p1, *p2, *p = rfiles;
-	while ( (p1=strchr(p, '\012'))!=NULL ) {
-		*p1++ = 0;
-		if ( ldir[-1]=='/' ) {		//lpath is a directory
-			p2 = strrchr(p, '/');
-			if ( p2==NULL ) p2=p; else p2++;
-			strcpy(ldir, p2);
-		}
-		scp_read_one( ph, p, lfile);
-		p = p1;
-		*ldir = 0;
+	w->hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+	w->hIdle = CreateEvent(NULL, FALSE, TRUE, NULL);
+	if ( w->hWork!=NULL && w->hIdle!=NULL ) 
+		w->hThread = CreateThread(NULL, 0, writer_thread, w, 0, NULL);
+	return TRUE;			//without the thread, writes are done inline
+}
+void writer_Flush(struct disk_writer *w)
+{
+	if ( w->hThread==NULL ) {
+		size_t len = w->len[w->fill];
+		if ( w->bHash ) sha256_Data(&w->sha, w->mem[w->fill], len);
+		DWORD t = GetTickCount();
+		if ( fwrite(w->mem[w->fill], 1, len, w->fp)!=len ) w->bError = TRUE;
+		w->disk_ms += GetTickCount()-t;
+		w->wait_ms += GetTickCount()-t;
+		w->len[w->fill] = 0;
+		return;
 	}
+	DWORD t = GetTickCount();
+	WaitForSingleObject(w->hIdle, INFINITE);	//previous buffer is written
+	w->wait_ms += GetTickCount()-t;
+	w->fill ^= 1;
+	w->bBusy = TRUE;
+	SetEvent(w->hWork);
 }
-void scp_write(HOST *ph, char *lpath, char *rpath)
+//the session owner must not wait on the disk, it asks before each read
+//from the host if len bytes can be taken without a flush that would block
+BOOL writer_Ready(struct disk_writer *w, int len)
 {
-	DIR *dir;
-	struct dirent *dp;
-	struct _stat statbuf;
-
-	if ( stat_utf8(lpath, &statbuf)!=-1 ) {	//lpath exist
-		char rfile[4096];
-		strncpy(rfile, rpath, 1024);
-		rfile[1024] = 0;
-		if ( rpath[strlen(rpath)-1]=='/' ) {//rpath specifies a directory
-			char *p = strrchr(lpath, '/');	//build rfile
-			if ( p==NULL ) p=lpath; else p++;
-			strcat(rfile, p);
-		}
-		scp_write_one( ph, lpath, rfile);
+	BOOL bReady = w->hThread==NULL || !w->bBusy 
+							|| w->len[w->fill]+len<WRITER_SIZE;
+	if ( !bReady && w->stall==0 ) w->stall = GetTickCount();
+	if ( bReady && w->stall!=0 ) {		//time the host was held back
+		w->wait_ms += GetTickCount()-w->stall;
+		w->stall = 0;
+	}
+	return bReady;
+}
+BOOL writer_Drain(struct disk_writer *w)	//TRUE once all is on disk
+{
+	if ( w->hThread==NULL ) return TRUE;
+	if ( w->bBusy ) return FALSE;
+	if ( w->len[w->fill]==0 ) return TRUE;
+	writer_Flush(w);					//thread is idle, this won't wait
+	return FALSE;
+}
+int writer_Write(struct disk_writer *w, const char *buf, int len)
+{
+	if ( w->bError ) return -1;
+	for ( int n=len; n>0; ) {
+		size_t cnt = min((size_t)n, WRITER_SIZE-w->len[w->fill]);
+		memcpy(w->mem[w->fill]+w->len[w->fill], buf, cnt);
+		w->len[w->fill] += cnt;
+		buf += cnt;
+		n -= (int)cnt;
+		if ( w->len[w->fill]==WRITER_SIZE ) writer_Flush(w);
+	}
+	return len;
+}
+BOOL writer_Close(struct disk_writer *w)//FALSE if any write failed
+{
+	if ( w->fp==NULL ) return TRUE;
+	if ( w->len[w->fill]>0 ) writer_Flush(w);
+	if ( w->hThread!=NULL ) {
+		DWORD t = GetTickCount();
+		WaitForSingleObject(w->hIdle, INFINITE);
+		w->wait_ms += GetTickCount()-t;
+		w->bQuit = TRUE;
+		SetEvent(w->hWork);
+		WaitForSingleObject(w->hThread, INFINITE);
+		CloseHandle(w->hThread);
+	}
+	if ( w->hWork!=NULL ) CloseHandle(w->hWork);
+	if ( w->hIdle!=NULL ) CloseHandle(w->hIdle);
+	free(w->mem[0]);
+	if ( w->bHash ) sha256_Close(&w->sha, w->hex);
+	fflush(w->fp);
+	_chsize_s(_fileno(w->fp), _ftelli64(w->fp));	//drop preallocated tail
+	w->fp = NULL;
+	return !w->bError;
+}
+#define READER_SIZE 1024*256
+struct disk_reader {				//file reads ahead of network writes
+	FILE *fp;
+	char *mem[2];
+	size_t len[2];
+	volatile BOOL bReady[2];		//filled by the reader thread
+	int use;						//buffer being sent by network side
+	HANDLE hThread, hWork;
+	volatile BOOL bQuit;
+	volatile BOOL bError;			//read stopped by a disk error, not eof
+	DWORD stall, wait_ms;			//wait_ms is time the host waited on disk
+};
+DWORD WINAPI reader_thread(void *pv)
+{
+	struct disk_reader *r = (struct disk_reader *)pv;
+	int i = 0;
+	while ( !r->bQuit ) {
+		if ( r->bReady[i] ) {			//both full, wait for one to be sent
+			WaitForSingleObject(r->hWork, INFINITE);
+			continue;
+		}
+		r->len[i] = fread(r->mem[i], 1, READER_SIZE, r->fp);
+		if ( r->len[i]==0 ) r->bError = ferror(r->fp)!=0;
+		MemoryBarrier();
+		r->bReady[i] = TRUE;
+		if ( r->len[i]==0 ) break;		//end of file or read error
+		i ^= 1;
+	}
+	return 0;
+}
+BOOL reader_Open(struct disk_reader *r, FILE *fp)
+{
+	memset(r, 0, sizeof(struct disk_reader));
+	r->mem[0] = (char *)malloc(READER_SIZE*2);
+	if ( r->mem[0]==NULL ) return FALSE;
+	r->mem[1] = r->mem[0]+READER_SIZE;
+	r->fp = fp;
+	r->hWork = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if ( r->hWork!=NULL ) 
+		r->hThread = CreateThread(NULL, 0, reader_thread, r, 0, NULL);
+	return TRUE;			//without the thread, reads are done inline
+}
+int reader_Get(struct disk_reader *r, char **buf)//-1 not read yet, 0 at end
+{
+	int i = r->use;
+	if ( r->hThread==NULL && !r->bReady[i] ) {
+		r->len[i] = fread(r->mem[i], 1, READER_SIZE, r->fp);
+		if ( r->len[i]==0 ) r->bError = ferror(r->fp)!=0;
+		r->bReady[i] = TRUE;
+	}
+	if ( !r->bReady[i] ) {
+		if ( r->stall==0 ) r->stall = GetTickCount();
+		return -1;
+	}
+	if ( r->stall!=0 ) {				//time the host was held back
+		r->wait_ms += GetTickCount()-r->stall;
+		r->stall = 0;
+	}
+	*buf = r->mem[i];
+	return (int)r->len[i];
+}
+void reader_Done(struct disk_reader *r)	//buffer from reader_Get is sent
+{
+	r->bReady[r->use] = FALSE;
+	r->use ^= 1;
+	if ( r->hWork!=NULL ) SetEvent(r->hWork);
+}
+void reader_Close(struct disk_reader *r)
+{
+	if ( r->mem[0]==NULL ) return;
+	if ( r->hThread!=NULL ) {
+		r->bQuit = TRUE;
+		SetEvent(r->hWork);
+		WaitForSingleObject(r->hThread, INFINITE);	//at most one fread
+		CloseHandle(r->hThread);
+	}
+	if ( r->hWork!=NULL ) CloseHandle(r->hWork);
+	free(r->mem[0]);
+	r->mem[0] = NULL;
+}
+void print_disk(TERM *pt, DWORD elapsed, DWORD disk_ms)
+{
+	if ( elapsed<disk_ms ) elapsed = disk_ms;
+	term_Print(pt, ", net/disk %lu/%lums", elapsed-disk_ms, disk_ms);
+}
+BOOL progress_Due(DWORD *last)		//progress is shown 4 times a second
+{
+	DWORD now = GetTickCount();
+	if ( now-*last<250 ) return FALSE;
+	*last = now;
+	return TRUE;
+}
+void bucket_Init(struct Bucket *b, int limit)	//limit in Kbit/s like scp -l
+{
+	b->rate = limit>0 ? limit*125 : 0;
+	b->tokens = 0;
+	b->tick = GetTickCount();
+}
+//bytes of want that can be sent now, owner thread asks again later if 0
+int bucket_Room(HOST *ph, struct Bucket *b, int want)
+{
+	if ( b->rate==0 || want==0 ) return want;
+	DWORD now = GetTickCount();
+	DWORD elapsed = min(now-b->tick, 1000);
+	int burst = max(b->rate/8, 1024);	//at most 1/8 second at full rate
+	b->tokens = (int)min((long long)b->tokens+(long long)elapsed*b->rate/1000,
+																burst);
+	b->tick = now;
+	if ( b->tokens>0 ) return min(want, b->tokens);
+	DWORD ms = (DWORD)((1000LL*(1-b->tokens)+b->rate-1)/b->rate);
+	if ( ms<ph->poll_ms ) ph->poll_ms = max(ms, 1);
+	return 0;
+}
+void bucket_Spend(struct Bucket *b, int n)
+{
+	if ( b->rate>0 ) b->tokens -= n;
+}
+void print_total(TERM *pt, time_t start, long long total)
+{
+	double duration = difftime(time(NULL), start);
+	term_Print(pt, "\033[12D%lld bytes", total);
+	if ( duration>0 ) 
+		term_Print(pt, ", %dMB/s", (int)((total>>20)/duration));
+}
+enum scpState {SCP_OPEN, SCP_DATA, SCP_EOF, SCP_WAIT_EOF, SCP_WAIT_CLOSED,
+				SCP_CLOSE};
+struct scp_batch {					//scp transfers of one command
+	int id;							//shown by !Xfer
+	HOST *ph;
+	BOOL bRead, bQuiet;				//quiet if run in background
+	char *lpath, *rpath;			//rpath is the file list for bRead
+	int state;
+	volatile BOOL bCancel;
+	int max;						//transfers allowed at the same time
+	volatile LONG running;
+	int count, files;				//count is 0 if not known in advance
+	volatile LONG failed;			//owner thread and caller both count
+	volatile libssh2_struct_stat_size total;
+	time_t start;
+	struct Bucket bucket;			//-l limit, shared by files of the batch
+	HANDLE hSlot;					//set each time a transfer finishes
+	BOOL bVerify;
+	struct scp_check *checks, **last;//files to verify at the end
+	struct scp_batch *next;
+};
+enum xferState {XFER_QUEUED, XFER_RUNNING};
+struct scp_check {
+	char *rpath, *lpath;
+	BOOL bPut;
+	char hex[65];					//hash of download, taken while written
+	struct file_hash *fh;			//hash of upload, taken while sent
+	struct scp_check *next;
+};
+struct scp_job {					//one scp transfer, run by session owner
+	char *rpath, *lpath;
+	const char *name;				//destination, shown to user
+	struct scp_batch *batch;
+	LIBSSH2_CHANNEL *channel;
+	libssh2_struct_stat fileinfo;
+	FILE *fp;
+	int state;
+	DWORD last;						//last progress update
+	time_t start;
+	libssh2_struct_stat_size total;
+	char mem[1024*32];
+	size_t nread;					//bytes in mem not yet written to host
+	char *ptr;
+	struct disk_writer w;			//download, file written on its own thread
+	BOOL bDrain;					//download, waiting for the writer
+	struct disk_reader r;			//upload, file read on its own thread
+	DWORD tick;						//upload start
+	struct file_hash *fh;			//upload, hashed while sent if verifying
+};
+int scp_close_step(HOST *ph, struct Job *job)
+{
+	struct scp_job *scp = (struct scp_job *)job->ctx;
+	if ( job->bCancel ) {
+		writer_Close(&scp->w);
+		reader_Close(&scp->r);
+		if ( scp->fp!=NULL ) fclose(scp->fp);
+		if ( scp->channel!=NULL ) libssh2_channel_free(scp->channel);
+		scp->fp = NULL;
+		scp->channel = NULL;
+		return 0;
+	}
+	int rc = libssh2_channel_close(scp->channel);
+	if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+	rc = libssh2_channel_free(scp->channel);
+	if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+	scp->channel = NULL;
+	return 0;
+}
+BOOL scp_single(struct scp_batch *batch)	//one file, with progress shown
+{
+	return batch->max==1 && !batch->bQuiet;
+}
+int scp_cancel(HOST *ph, struct Job *job)	//stopped with !Xfer cancel
+{
+	struct scp_job *scp = (struct scp_job *)job->ctx;
+	writer_Close(&scp->w);
+	reader_Close(&scp->r);
+	if ( scp->fp!=NULL ) fclose(scp->fp);
+	scp->fp = NULL;
+	job->rc = -1;
+	if ( scp->channel==NULL ) return 0;
+	scp->state = SCP_CLOSE;
+	return 1;
+}
+void scp_error(HOST *ph, struct Job *job, const char *msg)
+{
+	struct scp_job *scp = (struct scp_job *)job->ctx;
+	if ( scp->batch->bQuiet )
+		;
+	else if ( scp->batch->max==1 )
+		term_Print(ph->term, "%s\033[31m%s", 
+							scp->state==SCP_DATA ? ", " : "", msg);
+	else 
+		term_Print(ph->term, "\r\n\033[32mscp: %s\t\t\t\033[31m%s",
+							scp->name, msg);
+	job->rc = -1;
+}
+int scp_done(HOST *ph, struct Job *job, int rc)
+{
+	if ( rc!=0 ) return rc;
+	struct scp_job *scp = (struct scp_job *)job->ctx;
+	struct scp_batch *batch = scp->batch;
+	if ( job->rc!=0 ) 
+		InterlockedIncrement(&batch->failed);
+	else if ( batch->max>1 && !batch->bQuiet && !job->bCancel ) 
+		term_Print(ph->term, "\r\n\033[32mscp: %s\t\t\t%lld bytes", 
+							scp->name, (long long)scp->total);
+	struct scp_check *check = NULL;
+	if ( job->rc==0 && batch->bVerify && !job->bCancel ) 
+		check = (struct scp_check *)malloc(sizeof(struct scp_check));
+	if ( check!=NULL ) {
+		check->rpath = scp->rpath;
+		check->lpath = scp->lpath;
+		check->bPut = scp->fh!=NULL;
+		strcpy(check->hex, scp->w.hex);
+		check->fh = scp->fh;
+		check->next = NULL;
+		*batch->last = check;
+		batch->last = &check->next;
+	}
+	else {
+		if ( scp->fh!=NULL ) {
+			hash_Wait(scp->fh);
+			free(scp->fh);
+		}
+		free(scp->rpath);
+		free(scp->lpath);
+	}
+	free(scp);
+	if ( batch->hSlot!=NULL ) SetEvent(batch->hSlot);
+	InterlockedDecrement(&batch->running);	//batch may be gone after this
+	return 0;
+}
+int scp_read_end(HOST *ph, struct Job *job)	//file done, or given up
+{
+	struct scp_job *scp = (struct scp_job *)job->ctx;
+	if ( !writer_Drain(&scp->w) ) {
+		if ( ph->poll_ms>5 ) ph->poll_ms = 5;	//writer can't wake us
+		return LIBSSH2_ERROR_EAGAIN;
+	}
+	if ( !writer_Close(&scp->w) && job->rc==0 ) {
+		scp_error(ph, job, "error writing to file");
+		scp->total = 0;
+	}
+	fclose(scp->fp);
+	scp->fp = NULL;
+	if ( scp->total==scp->fileinfo.st_size && scp_single(scp->batch) ) {
+		print_total(ph->term, scp->start, scp->total);
+		print_disk(ph->term, GetTickCount()-scp->w.start, scp->w.wait_ms);
+	}
+	scp->state = SCP_CLOSE;
+	return 1;
+}
+int scp_read_step(HOST *ph, struct Job *job)
+{
+	struct scp_job *scp = (struct scp_job *)job->ctx;
+	if ( job->bCancel ) return scp_close_step(ph, job);
+	if ( scp->batch->bCancel && scp->state<SCP_CLOSE ) 
+		return scp_cancel(ph, job);
+
+	switch ( scp->state ) {
+	case SCP_OPEN:
+		scp->channel = libssh2_scp_recv2(ph->session, scp->rpath,
+														&scp->fileinfo);
+		if ( !scp->channel ) {
+			int err_no = libssh2_session_last_errno(ph->session);
+			if ( err_no==LIBSSH2_ERROR_EAGAIN ) return err_no;
+			scp_error(ph, job, "couldn't open remote file");
+			return 0;
+		}
+		scp->fp = fopen_utf8(scp->lpath, "wb");
+		if ( scp->fp==NULL ) {
+			scp_error(ph, job, "couldn't write to local file");
+			scp->state = SCP_CLOSE;
+			return 1;
+		}
+		if ( !writer_Open(&scp->w, scp->fp, scp->fileinfo.st_size,
+											scp->batch->bVerify) ) {
+			scp_error(ph, job, "out of memory");
+			fclose(scp->fp);
+			scp->fp = NULL;
+			scp->state = SCP_CLOSE;
+			return 1;
+		}
+		scp->start = time(NULL);
+		scp->state = SCP_DATA;
+		return 1;
+	case SCP_DATA: {
+		if ( scp->bDrain ) return scp_read_end(ph, job);
+		libssh2_struct_stat_size fsize = scp->fileinfo.st_size;
+		int amount=sizeof(scp->mem);
+		if ( (fsize-scp->total) < amount) {
+			amount = (int)(fsize-scp->total);
+		}
+		if ( amount>0 && !writer_Ready(&scp->w, amount) ) {
+			if ( ph->poll_ms>5 ) ph->poll_ms = 5;	//disk is behind
+			return LIBSSH2_ERROR_EAGAIN;
+		}
+		if ( amount>0 ) {
+			amount = bucket_Room(ph, &scp->batch->bucket, amount);
+			if ( amount==0 ) return LIBSSH2_ERROR_EAGAIN;
+		}
+		int rc = amount>0 ? libssh2_channel_read(scp->channel, scp->mem,
+													amount) : 0;
+		if ( rc>0 ) {
+			bucket_Spend(&scp->batch->bucket, rc);
+			int nwrite = writer_Write(&scp->w, scp->mem, rc);
+			if ( nwrite>0 ) {
+				scp->total += nwrite;
+				scp->batch->total += nwrite;
+				if ( scp_single(scp->batch) && progress_Due(&scp->last) )
+					term_Print(ph->term, "\033[12D% 10lldKB",
+								(long long)scp->total>>10);
+			}
+			if ( nwrite!=rc ) {
+				scp_error(ph, job, "error writing to file");
+				amount = 0;
+			}
+		}
+		else if ( rc<0 ) {
+			if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+			scp_error(ph, job, "error reading from host");
+			amount = 0;
+		}
+		else if ( amount>0 )
+			return LIBSSH2_ERROR_EAGAIN;
+		if ( amount==0 || scp->total==fsize ) {
+			scp->bDrain = TRUE;
+			return scp_read_end(ph, job);
+		}
+		return 1;
+	}
+	default:
+		return scp_close_step(ph, job);
+	}
+}
+int scp_read_job(HOST *ph, struct Job *job)
+{
+	return scp_done(ph, job, scp_read_step(ph, job));
+}
+int scp_write_step(HOST *ph, struct Job *job)
+{
+	struct scp_job *scp = (struct scp_job *)job->ctx;
+	if ( job->bCancel ) return scp_close_step(ph, job);
+	if ( scp->batch->bCancel && scp->state<SCP_CLOSE ) 
+		return scp_cancel(ph, job);
+
+	int rc = 0;
+	switch ( scp->state ) {
+	case SCP_OPEN:
+		scp->channel = libssh2_scp_send64(ph->session, scp->rpath,
+										scp->fileinfo.st_mode&0777,
+										scp->fileinfo.st_size, 0, 0);
+		if ( !scp->channel ) {
+			int err_no = libssh2_session_last_errno(ph->session);
+			if ( err_no==LIBSSH2_ERROR_EAGAIN ) return err_no;
+			scp_error(ph, job, "couldn't create remote file");
+			fclose(scp->fp);
+			scp->fp = NULL;
+			return 0;
+		}
+		if ( !reader_Open(&scp->r, scp->fp) ) {
+			scp_error(ph, job, "out of memory");
+			fclose(scp->fp);
+			scp->fp = NULL;
+			scp->state = SCP_EOF;
+			return 1;
+		}
+		scp->start = time(NULL);
+		scp->tick = GetTickCount();
+		scp->state = SCP_DATA;
+		return 1;
+	case SCP_DATA:
+		if ( scp->nread==0 ) {
+			int n = reader_Get(&scp->r, &scp->ptr);
+			if ( n<0 ) {						//disk is behind
+				if ( ph->poll_ms>5 ) ph->poll_ms = 5;
+				return LIBSSH2_ERROR_EAGAIN;
+			}
+			scp->nread = n;
+			if ( scp->nread==0 ) {				//end of file
+				//short of the size given to scp_send, the remote file
+				//is incomplete whatever the reason
+				if ( scp->r.bError || scp->total!=scp->fileinfo.st_size ) 
+					scp_error(ph, job, "error reading local file");
+				else if ( scp_single(scp->batch) ) {
+					print_total(ph->term, scp->start, scp->total);
+					print_disk(ph->term, GetTickCount()-scp->tick, 
+													scp->r.wait_ms);
+				}
+				reader_Close(&scp->r);
+				fclose(scp->fp);
+				scp->fp = NULL;
+				scp->state = SCP_EOF;
+				return 1;
+			}
+		}
+		if ( ph->klen>0 ) return LIBSSH2_ERROR_EAGAIN;	//keystrokes first
+		rc = bucket_Room(ph, &scp->batch->bucket, (int)scp->nread);
+		if ( rc==0 ) return LIBSSH2_ERROR_EAGAIN;
+		rc = libssh2_channel_write(scp->channel, scp->ptr, rc);
+		if ( rc>0 ) {
+			bucket_Spend(&scp->batch->bucket, rc);
+			scp->ptr += rc;
+			scp->nread -= rc;
+			if ( scp->nread==0 ) reader_Done(&scp->r);
+			scp->total += rc;
+			scp->batch->total += rc;
+			if ( scp_single(scp->batch) && progress_Due(&scp->last) )
+				term_Print(ph->term, "\033[12D% 10lldKB",
+								(long long)scp->total>>10);
+			return 1;
+		}
+		if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+		scp_error(ph, job, "error writing to host");
+		reader_Close(&scp->r);
+		fclose(scp->fp);
+		scp->fp = NULL;
+		scp->state = SCP_EOF;
+		return 1;
+	case SCP_EOF:
+		rc = libssh2_channel_send_eof(scp->channel);
+		break;
+	case SCP_WAIT_EOF:
+		rc = libssh2_channel_wait_eof(scp->channel);
+		break;
+	case SCP_WAIT_CLOSED:
+		rc = libssh2_channel_wait_closed(scp->channel);
+		break;
+	default:
+		return scp_close_step(ph, job);
+	}
+	if ( rc==LIBSSH2_ERROR_EAGAIN ) return rc;
+	scp->state++;
+	return 1;
+}
+int scp_write_job(HOST *ph, struct Job *job)
+{
+	return scp_done(ph, job, scp_write_step(ph, job));
+}
+struct scp_batch *xfer_list = NULL;	//running and queued scp commands
+BOOL bXferThread = FALSE;			//background batches are being run
+int xfer_id = 0;
+
+DWORD WINAPI xfer_thread(void *pv);
+//register a batch, returns it if the caller should run it now, or NULL if
+//it was queued to run in background or couldn't be created
+struct scp_batch *scp_begin(HOST *ph, BOOL bRead, char *lpath, char *rpath,
+											BOOL bBackground, int limit)
+{
+	struct scp_batch *batch = (struct scp_batch *)
+								malloc(sizeof(struct scp_batch));
+	if ( batch==NULL ) return NULL;
+	memset(batch, 0, sizeof(struct scp_batch));
+	batch->lpath = strdup(lpath);
+	batch->rpath = strdup(rpath);
+	batch->hSlot = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if ( batch->lpath==NULL || batch->rpath==NULL || batch->hSlot==NULL ) {
+		free(batch->lpath);
+		free(batch->rpath);
+		if ( batch->hSlot!=NULL ) CloseHandle(batch->hSlot);
+		free(batch);
+		return NULL;
+	}
+	batch->ph = ph;
+	batch->bRead = bRead;
+	batch->bQuiet = bBackground;
+	batch->state = bBackground ? XFER_QUEUED : XFER_RUNNING;
+	batch->max = ph->scp_jobs;
+	batch->start = time(NULL);
+	bucket_Init(&batch->bucket, limit);
+	batch->bVerify = ph->bVerify;
+	batch->checks = NULL;
+	batch->last = &batch->checks;
+
+	BOOL bRun = !bBackground;
+	if ( WaitForSingleObject(mtx_xfer, INFINITE)==WAIT_OBJECT_0 ) {
+		batch->id = ++xfer_id;
+		struct scp_batch **pp = &xfer_list;
+		while ( *pp!=NULL ) pp = &(*pp)->next;
+		*pp = batch;
+		if ( bBackground && !bXferThread ) {
+			HANDLE h = CreateThread(NULL, 0, xfer_thread, NULL, 0, NULL);
+			if ( h!=NULL ) {
+				bXferThread = TRUE;
+				CloseHandle(h);
+			}
+			else {							//run it here after all
+				batch->state = XFER_RUNNING;
+				batch->bQuiet = FALSE;
+				bRun = TRUE;
+			}
+		}
+		ReleaseMutex(mtx_xfer);
+	}
+	return bRun ? batch : NULL;
+}
+void scp_wait(struct scp_batch *batch, int n)//until n or less are running
+{
+	while ( batch->running>n ) {			//event may come before the count
+		WaitForSingleObject(batch->hSlot, 100);
+	}
+}
+//compare local hashes with sha256sum of the remote files, one exec
+//channel for as many files as fit in a command line
+void scp_verify(HOST *ph, struct scp_batch *batch)
+{
+	char cmd[8192], out[16384];
+	struct scp_check *first = batch->checks;
+	while ( first!=NULL ) {
+		int len = 0;
+		struct scp_check *c, *next;
+		for ( c=first; c!=NULL; c=c->next ) {
+			if ( c!=first && len+strlen(c->rpath)*4+48>sizeof(cmd) ) break;
+			len += sprintf(cmd+len, "sha256sum <");
+			len += sh_quote(cmd+len, c->rpath);
+			len += sprintf(cmd+len, " 2>/dev/null || echo x;");
+		}
+		if ( ssh2_Exec(ph, cmd, out, sizeof(out))<0 ) *out = 0;
+		char *p = out;
+		for ( struct scp_check *d=first; d!=c; d=next ) {
+			next = d->next;
+			char *hex = d->fh!=NULL ? hash_Wait(d->fh) : d->hex;
+			char *eol = strchr(p, '\n');
+			const char *result = NULL;
+			if ( *hex==0 ) 
+				result = "\033[31mno local hash";
+			else if ( eol==NULL || eol-p<64 ) 
+				result = "\033[31mno remote hash";
+			else if ( strncmp(p, hex, 64)!=0 ) {
+				result = "\033[31msha256 mismatch";
+				InterlockedIncrement(&batch->failed);
+			}
+			if ( !batch->bQuiet ) {
+				term_Print(ph->term, "\r\n\033[32mverify: %s\t\t\t",
+									d->bPut ? d->rpath : d->lpath);
+				if ( result!=NULL ) 
+					term_Print(ph->term, "%s", result);
+				else
+					term_Print(ph->term, "sha256 %.16s ok", hex);
+			}
+			if ( eol!=NULL ) p = eol+1;
+			free(d->fh);
+			free(d->rpath);
+			free(d->lpath);
+			free(d);
+		}
+		first = c;
+	}
+	batch->checks = NULL;
+}
+void scp_end(HOST *ph, struct scp_batch *batch)
+{
+	scp_wait(batch, 0);
+	CloseHandle(batch->hSlot);
+	scp_verify(ph, batch);
+	if ( batch->bQuiet ) 
+		term_Print(ph->term, "\r\n\033[32mscp: #%d %s, %d files, %d failed",
+					batch->id, batch->bCancel ? "cancelled" : "done",
+					batch->files, (int)batch->failed);
+	else if ( batch->max>1 && batch->files>0 ) {
+		term_Print(ph->term, "\r\n\033[32mscp: %d files, %d failed\t\t",
+								batch->files, (int)batch->failed);
+		print_total(ph->term, batch->start, batch->total);
+	}
+
+	if ( WaitForSingleObject(mtx_xfer, INFINITE)==WAIT_OBJECT_0 ) {
+		struct scp_batch **pp = &xfer_list;
+		while ( *pp!=NULL && *pp!=batch ) pp = &(*pp)->next;
+		if ( *pp!=NULL ) *pp = batch->next;
+		ReleaseMutex(mtx_xfer);
+	}
+	free(batch->lpath);
+	free(batch->rpath);
+	free(batch);
+	SetEvent(xfer_done);
+}
+int scp_start(HOST *ph, struct scp_batch *batch, 
+			int (*step)(HOST *, struct Job *), struct scp_job *scp)
+{
+	scp->batch = batch;
+	batch->files++;
+	InterlockedIncrement(&batch->running);
+	if ( ssh2_Job(ph, step, scp, FALSE)==0 ) {
+		if ( batch->max==1 ) scp_wait(batch, 0);	//keeps output in order
+		return 0;
+	}
+	InterlockedDecrement(&batch->running);	//session was gone
+	InterlockedIncrement(&batch->failed);
+	if ( scp->fp!=NULL ) fclose(scp->fp);
+	if ( scp->fh!=NULL ) {
+		hash_Wait(scp->fh);
+		free(scp->fh);
+	}
+	free(scp->rpath);
+	free(scp->lpath);
+	free(scp);
+	return -1;
+}
+int scp_read_one(HOST *ph, struct scp_batch *batch, 
+				const char *rpath, const char *lpath)
+{
+	scp_wait(batch, batch->max-1);
+	struct scp_job *scp = (struct scp_job *)malloc(sizeof(struct scp_job));
+	if ( scp==NULL ) return -1;
+	memset(scp, 0, sizeof(struct scp_job));
+	scp->rpath = strdup(rpath);
+	scp->lpath = strdup(lpath);
+	scp->name = scp->lpath;
+	if ( scp_single(batch) ) 
+		term_Print(ph->term, "\r\n\033[32mscp: %s\t\t\t", lpath);
+	return scp_start(ph, batch, scp_read_job, scp);
+}
+int scp_write_one(HOST *ph, struct scp_batch *batch, 
+				const char *lpath, const char *rpath)
+{
+	scp_wait(batch, batch->max-1);
+	FILE *fp =fopen_utf8(lpath, "rbS");			//sequential read ahead
+	if ( !fp ) {
+		if ( !batch->bQuiet )
+			term_Print(ph->term, "\r\n\033[32mscp: %s\t\t\t"
+						"\033[31mcouldn't read local file", rpath);
+		InterlockedIncrement(&batch->failed);
+		return -1;
+	}
+	struct scp_job *scp = (struct scp_job *)malloc(sizeof(struct scp_job));
+	if ( scp==NULL ) {
+		fclose(fp);
+		return -1;
+	}
+	memset(scp, 0, sizeof(struct scp_job));
+	struct _stat64 fileinfo;
+	stat_utf8(lpath, &fileinfo);
+	scp->fileinfo.st_mode = fileinfo.st_mode;
+	scp->fileinfo.st_size = fileinfo.st_size;
+	scp->lpath = strdup(lpath);
+	scp->rpath = strdup(rpath);
+	scp->name = scp->rpath;
+	scp->fp = fp;
+	if ( batch->bVerify ) scp->fh = hash_Start(lpath);
+	if ( scp_single(batch) ) 
+		term_Print(ph->term, "\r\n\033[32mscp: %s\t\t\t", rpath);
+	return scp_start(ph, batch, scp_write_job, scp);
+}
+void scp_read_files(HOST *ph, struct scp_batch *batch)
+{
+	char *lpath = batch->lpath, *rfiles = batch->rpath;
+	for ( char *p=rfiles; (p=strchr(p, '\012'))!=NULL; p++ ) 
+		batch->count++;
+	if ( batch->count<=1 ) batch->max = 1;	//single file shows progress
+
+	char lfile[4096];
+	strncpy(lfile, lpath, 1024);
+	lfile[1024] = 0;
+
+	struct _stat64 statbuf;
+	if ( stat_utf8(lpath, &statbuf)!=-1 ) {
+		if ( (statbuf.st_mode & S_IFMT) == S_IFDIR ) 
+			strcat(lfile, "/");
+	}
+	char *ldir = lfile+strlen(lfile);
+
+	char *p1, *p2, *p = rfiles;
+	while ( !batch->bCancel && (p1=strchr(p, '\012'))!=NULL ) {
+		*p1++ = 0;
+		if ( ldir[-1]=='/' ) {		//lpath is a directory
+			p2 = strrchr(p, '/');
+			if ( p2==NULL ) p2=p; else p2++;
+			strcpy(ldir, p2);
+		}
+		scp_read_one( ph, batch, p, lfile);
+		p = p1;
+		*ldir = 0;
+	}
+}
+void scp_write_files(HOST *ph, struct scp_batch *batch)
+{
+	DIR *dir;
+	struct dirent *dp;
+	struct _stat64 statbuf;
+	char lpath[1024], *rpath = batch->rpath;
+	strncpy(lpath, batch->lpath, 1023);
+	lpath[1023] = 0;
+
+	if ( stat_utf8(lpath, &statbuf)!=-1 ) {	//lpath exist
+		char rfile[4096];
+		strncpy(rfile, rpath, 1024);
+		rfile[1024] = 0;
+		if ( rpath[strlen(rpath)-1]=='/' ) {//rpath specifies a directory
+			char *p = strrchr(lpath, '/');	//build rfile
+			if ( p==NULL ) p=lpath; else p++;
+			strcat(rfile, p);
+		}
+		batch->count = 1;
+		batch->max = 1;						//single file shows progress
+		scp_write_one( ph, batch, lpath, rfile);
 	}
 	else {									//lpath specifies a pattern
 		char *ldir=".";
@@ -752,7 +2031,7 @@ void scp_write(HOST *ph, char *lpath, char *rpath)
 			lpattern = lpath;
 		int cnt = 0;
 		if ( (dir=opendir(ldir) ) != NULL ) {
-			while ( (dp=readdir(dir)) != NULL ) {
+			while ( !batch->bCancel && (dp=readdir(dir)) != NULL ) {
 				if ( dp->d_type!=DT_REG ) continue;
 				if ( fnmatch(lpattern, dp->d_name, 0)==0 ) {
 					cnt++;
@@ -763,41 +2042,192 @@ void scp_write(HOST *ph, char *lpath, char *rpath)
 					strcpy(rfile, rpath);
 					if ( rpath[strlen(rpath)-1]=='/' )
 						strcat(rfile, dp->d_name);
-					scp_write_one( ph, lfile, rfile);
+					scp_write_one( ph, batch, lfile, rfile);
 				}
 			}
 			closedir(dir);
 		}
-		if ( cnt==0 ) 
+		if ( cnt==0 && !batch->bQuiet ) 
 			term_Print(ph->term, "\r\n\033[31mscp: %s/%s no mathcing file",
 												ldir, lpattern);
 	}
 }
+void scp_run(struct scp_batch *batch)
+{
+	if ( batch->bRead ) 
+		scp_read_files(batch->ph, batch);
+	else
+		scp_write_files(batch->ph, batch);
+	scp_end(batch->ph, batch);
+}
+DWORD WINAPI xfer_thread(void *pv)		//runs background batches in turn
+{
+	while ( TRUE ) {
+		struct scp_batch *batch = NULL;
+		if ( WaitForSingleObject(mtx_xfer, INFINITE)==WAIT_OBJECT_0 ) {
+			for ( batch=xfer_list; batch!=NULL; batch=batch->next ) 
+				if ( batch->state==XFER_QUEUED ) break;
+			if ( batch!=NULL ) {
+				batch->state = XFER_RUNNING;
+				batch->start = time(NULL);
+			}
+			else
+				bXferThread = FALSE;
+			ReleaseMutex(mtx_xfer);
+		}
+		if ( batch==NULL ) break;
+		scp_run(batch);
+	}
+	return 0;
+}
+void scp_read(HOST *ph, char *lpath, char *rfiles, BOOL bBackground,
+																int limit)
+{
+	struct scp_batch *batch = scp_begin(ph, TRUE, lpath, rfiles,
+												bBackground, limit);
+	if ( batch!=NULL ) scp_run(batch);
+}
+void scp_write(HOST *ph, char *lpath, char *rpath, BOOL bBackground,
+																int limit)
+{
+	struct scp_batch *batch = scp_begin(ph, FALSE, lpath, rpath,
+												bBackground, limit);
+	if ( batch!=NULL ) scp_run(batch);
+}
+void xfer_List(TERM *pt)					//transfers of this session
+{
+	const char *states[] = {"queued", "running"};
+	if ( WaitForSingleObject(mtx_xfer, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( struct scp_batch *b=xfer_list; b!=NULL; b=b->next ) {
+			if ( b->ph!=pt->host ) continue;
+			double duration = difftime(time(NULL), b->start);
+			long long kb = (long long)b->total>>10;
+			term_Print(pt, "#%d\t%s %s\t%s%s, %d/%d files, %d failed, "
+					"%lldKB, %dKB/s\n", b->id, b->bRead ? "get" : "put", 
+					b->lpath, states[b->state], b->bCancel ? " cancelling" : "",
+					b->files-(int)b->running, b->count ? b->count : b->files,
+					(int)b->failed, kb, duration>0 ? (int)(kb/duration) : 0);
+		}
+		ReleaseMutex(mtx_xfer);
+	}
+}
+BOOL xfer_Cancel(HOST *ph, int id)		//id 0 cancels all of the session
+{
+	BOOL bFound = FALSE;
+	if ( WaitForSingleObject(mtx_xfer, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( struct scp_batch *b=xfer_list; b!=NULL; b=b->next ) {
+			if ( b->ph==ph && (id==0 || b->id==id) ) {
+				b->bCancel = TRUE;
+				bFound = TRUE;
+			}
+		}
+		ReleaseMutex(mtx_xfer);
+	}
+	return bFound;
+}
+//cancel transfers of a session, queued ones are dropped, running ones
+//are waited for until they let go of ph, the caller frees it after. they
+//end soon, the owner thread is gone so each transfer left fails at once
+void xfer_Drop(HOST *ph)
+{
+	BOOL bFound = TRUE;
+	while ( bFound ) {
+		bFound = FALSE;
+		if ( WaitForSingleObject(mtx_xfer, INFINITE)==WAIT_OBJECT_0 ) {
+			struct scp_batch **pp = &xfer_list;
+			while ( *pp!=NULL ) {
+				struct scp_batch *b = *pp;
+				if ( b->ph==ph && b->state==XFER_QUEUED ) {
+					*pp = b->next;			//never started, nobody else has it
+					CloseHandle(b->hSlot);
+					free(b->lpath);
+					free(b->rpath);
+					free(b);
+					continue;
+				}
+				if ( b->ph==ph ) {
+					b->bCancel = TRUE;
+					bFound = TRUE;
+				}
+				pp = &b->next;
+			}
+			ReleaseMutex(mtx_xfer);
+		}
+		if ( bFound ) WaitForSingleObject(xfer_done, 1000);
+	}
+}
 
-struct Tunnel *tun_add(HOST *ph, int tun_sock,
-						LIBSSH2_CHANNEL *tun_channel,
-						char *localip, unsigned short localport,
-						char *remoteip, unsigned short remoteport)
+void tun_link(HOST *ph, struct Tunnel *tun)
+{
+	if ( WaitForSingleObject(ph->mtx_tun, INFINITE)==WAIT_OBJECT_0 ) {
+		tun->next = ph->tunnel_list;
+		ph->tunnel_list = tun;
+		ReleaseMutex(ph->mtx_tun);
+	}
+	term_Print(ph->term, "\r\n\033[32mtunnel %d %s:%d %s:%d\r\n", tun->socket,
+				tun->localip, tun->localport, tun->remoteip, tun->remoteport);
+}
+struct Tunnel *tun_new(HOST *ph, int tun_sock,
+						const char *localip, unsigned short localport,
+						const char *remoteip, unsigned short remoteport)
 {
 	struct Tunnel *tun = (struct Tunnel *)malloc(sizeof(struct Tunnel));
 	if ( tun!=NULL ) {
 		tun->host = ph;
 		tun->socket = tun_sock;
-		tun->channel = tun_channel;
+		tun->channel = NULL;
 		tun->localip = strdup(localip);
 		tun->localport = localport;
-		tun->remoteip = strdup(remoteip);
+		tun->remoteip = remoteip!=NULL ? strdup(remoteip) : NULL;
 		tun->remoteport = remoteport;
-		if ( WaitForSingleObject(ph->mtx_tun, INFINITE)==WAIT_OBJECT_0 ) {
-			tun->next = ph->tunnel_list;
-			ph->tunnel_list = tun;
-			ReleaseMutex(ph->mtx_tun);
-		}
-		term_Print(ph->term, "\r\n\033[32mtunnel %d %s:%d %s:%d\r\n", tun_sock,
-							localip, localport, remoteip, remoteport);
+		tun->next = NULL;
+		tun->type = TUN_LOCAL;
+		tun->listener = NULL;
+		tun->bClose = tun->bReply = FALSE;
+		tun->closing = 0;
+		tun->parent = 0;
+		tun->tx = tun->rx = tun->win_bytes = 0;
+		tun->accepted = tun->opened = 0;
+		tun->start = tun->win_tick = GetTickCount();
+		tun->open_ms = tun->rate = 0;
+		tun->buflen = tun->bufoff = 0;
+		tun->dlen = tun->doff = 0;
+		bucket_Init(&tun->bucket, 0);
 	}
 	return tun;
 }
+struct Tunnel *tun_add(HOST *ph, int tun_sock,
+						LIBSSH2_CHANNEL *tun_channel,
+						char *localip, unsigned short localport,
+						char *remoteip, unsigned short remoteport)
+{
+	struct Tunnel *tun = tun_new(ph, tun_sock, localip, localport,
+											remoteip, remoteport);
+	if ( tun!=NULL ) {
+		tun->channel = tun_channel;
+		tun_link(ph, tun);
+	}
+	return tun;
+}
+struct Tunnel *tun_find(HOST *ph, int tun_sock)	//holding mtx_tun
+{
+	struct Tunnel *tun = ph->tunnel_list;
+	while ( tun!=NULL && tun->socket!=tun_sock ) tun = tun->next;
+	return tun;
+}
+void tun_opened(HOST *ph, struct Tunnel *tun)	//record open latency
+{
+	tun->open_ms = GetTickCount()-tun->start;
+	if ( tun->parent!=0 
+		&& WaitForSingleObject(ph->mtx_tun, INFINITE)==WAIT_OBJECT_0 ) {
+		struct Tunnel *listener = tun_find(ph, tun->parent);
+		if ( listener!=NULL ) {
+			listener->open_ms += tun->open_ms;
+			listener->opened++;
+		}
+		ReleaseMutex(ph->mtx_tun);
+	}
+}
 void tun_del(HOST *ph, int tun_sock)
 {
 	if ( WaitForSingleObject(ph->mtx_tun, INFINITE)==WAIT_OBJECT_0 ) {
@@ -805,6 +2235,12 @@ void tun_del(HOST *ph, int tun_sock)
 		struct Tunnel *tun = ph->tunnel_list;
 		while ( tun!=NULL ) {
 			if ( tun->socket==tun_sock ) {
+				struct Tunnel *listener = tun->parent!=0 ? 
+									tun_find(ph, tun->parent) : NULL;
+				if ( listener!=NULL ) {		//keep totals of the listener
+					listener->tx += tun->tx;
+					listener->rx += tun->rx;
+				}
 				free(tun->localip);
 				free(tun->remoteip);
 				if ( tun_pre!=NULL )
@@ -821,73 +2257,436 @@ void tun_del(HOST *ph, int tun_sock)
 		ReleaseMutex(ph->mtx_tun);
 	}
 }
+void tun_close(HOST *ph, struct Tunnel *tun)
+{
+	int tun_sock = tun->socket;
+	if ( tun->type==TUN_REMOTE && tun->channel==NULL ) {
+		tun->bClose = TRUE;			//listener on the server, owner cancels
+		ssh2_Wake(ph);
+	}
+	else if ( tun->channel==NULL ) {	//listening socket, polled by reactor
+		reactor_Del(tun_sock);
+		closesocket(tun_sock);
+		tun_del(ph, tun_sock);
+	}
+	else							//owner thread sees eof and cleans up
+		shutdown(tun_sock, SD_BOTH);
+}
 void tun_closeall(HOST *ph)
 {
 	if ( WaitForSingleObject(ph->mtx_tun, INFINITE)==WAIT_OBJECT_0 ) {
 		struct Tunnel *tun = ph->tunnel_list;
 		while ( tun!=NULL ) {
-			closesocket(tun->socket);
-			tun = tun->next;
+			struct Tunnel *next = tun->next;
+			tun_close(ph, tun);
+			tun = next;
 		}
+		ReleaseMutex(ph->mtx_tun);
 	}
-	ReleaseMutex(ph->mtx_tun);
 }
-DWORD WINAPI tun_worker(void *pv)
+void tun_free(struct Tunnel *tun)
 {
-	struct Tunnel *tun = (struct Tunnel *)pv;
-	LIBSSH2_CHANNEL *tun_channel = tun->channel;
-	HOST *ph = (HOST *)(tun->host);
+	free(tun->localip);
+	free(tun->remoteip);
+	free(tun);
+}
+BOOL recv_all(SOCKET s, char *buf, int len)	//FALSE on close or time out
+{
+	for ( int i=0, n; i<len; i+=n ) 
+		if ( (n=recv(s, buf+i, len-i, 0))<=0 ) return FALSE;
+	return TRUE;
+}
+void socks_reply(SOCKET s, int rep)
+{
+	char reply[10] = {5, rep, 0, 1};	//bound address not known, 0.0.0.0:0
+	send(s, reply, 10, 0);
+}
+int tun_step(HOST *ph, struct Job *job)	//relay a tunnel, on owner thread
+{
+	struct Tunnel *tun = (struct Tunnel *)job->ctx;
 	int tun_sock = tun->socket;
-	char buff[16384];
-	while ( TRUE ) {
-		fd_set fds;
-		FD_ZERO(&fds);
-		FD_SET(ph->sock, &fds);
-		FD_SET(tun_sock, &fds);
-		int rc = select(tun_sock+1, &fds, NULL, NULL, NULL);//blocking call
-		if ( rc==-1 ) break;
-		if ( rc==0 ) continue;
-		if ( FD_ISSET(tun_sock, &fds) ) {
-			int len = recv(tun_sock, buff, sizeof(buff), 0);
-			if ( len<=0 ) break;
-			for ( int wr=0, i=0; wr<len; wr+=i ) {
-				if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-					i = libssh2_channel_write(tun_channel, buff+wr, len-wr);
-					ReleaseMutex(ph->mtx);
-				}
-				if ( i==LIBSSH2_ERROR_EAGAIN ){ i=0; continue; }
-				if ( i<=0 ) goto shutdown;
+	if ( tun->channel==NULL ) {		//not in tunnel_list until channel opens
+		if ( !job->bCancel ) {
+			tun->channel = libssh2_channel_direct_tcpip_ex(ph->session,
+								tun->remoteip, tun->remoteport,
+								tun->localip, tun->localport);
+			if ( tun->channel!=NULL ) {
+				tun_opened(ph, tun);
+				if ( tun->bReply ) socks_reply(tun_sock, 0);
+				u_long nonblock = 1;		//partial sends, never stall owner
+				ioctlsocket(tun_sock, FIONBIO, &nonblock);
+				tun_link(ph, tun);
+				job->sock = tun_sock;
+				return 1;
 			}
+			if ( libssh2_session_last_errno(ph->session)==LIBSSH2_ERROR_EAGAIN )
+				return LIBSSH2_ERROR_EAGAIN;
+			term_Print(ph->term, "\033[31mCouldn't tunnel to %s:%d\r\n",
+								tun->remoteip, tun->remoteport);
+			if ( tun->bReply ) socks_reply(tun_sock, 5);
 		}
-		int len = 0;
-		if ( FD_ISSET(ph->sock, &fds) ) while ( TRUE ) {
-			if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-				len = libssh2_channel_read(tun_channel, buff, sizeof(buff));
-				ReleaseMutex(ph->mtx);
-			}
-			if ( len==LIBSSH2_ERROR_EAGAIN ) break;
-			if ( len<=0 ) goto shutdown;
-			for ( int wr=0, i=0; wr<len; wr+=i ) {
-				i = send(tun_sock, buff+wr, len-wr, 0);
-				if ( i<=0 ) break;
-			}
+		closesocket(tun_sock);
+		tun_free(tun);
+		return 0;
+	}
+	if ( tun_sock==INVALID_SOCKET ) {	//-R target couldn't be reached
+		if ( libssh2_channel_free(tun->channel)==LIBSSH2_ERROR_EAGAIN ) 
+			return LIBSSH2_ERROR_EAGAIN;
+		tun_free(tun);
+		return 0;
+	}
+	if ( job->bCancel || tun->closing ) goto shutdown;
+
+	int busy = 0;
+	if ( tun->buflen==0 && (job->revents&(POLLRDNORM|POLLHUP|POLLERR)) ) {
+		int len = recv(tun_sock, tun->buf, sizeof(tun->buf), 0);
+		if ( len==0 ) goto shutdown;
+		if ( len>0 ) {
+			tun->buflen = len;
+			tun->bufoff = 0;
 		}
+		else if ( WSAGetLastError()!=WSAEWOULDBLOCK ) goto shutdown;
 	}
-shutdown:
-	if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-		libssh2_channel_close(tun_channel);
-		libssh2_channel_free(tun_channel);
-		ReleaseMutex(ph->mtx);
+	int room = ph->klen>0 ? 0 : bucket_Room(ph, &tun->bucket, tun->buflen);
+	if ( room>0 ) {						//keystrokes go ahead of tunnels
+		int i = libssh2_channel_write(tun->channel, tun->buf+tun->bufoff,
+																room);
+		if ( i>0 ) {
+			bucket_Spend(&tun->bucket, i);
+			tun->bufoff += i;
+			tun->buflen -= i;
+			tun->tx += i;
+			busy++;
+		}
+		else if ( i!=LIBSSH2_ERROR_EAGAIN ) goto shutdown;
+	}
+	if ( tun->dlen==0 ) {				//host to socket, one buffer at a time
+		int len = bucket_Room(ph, &tun->bucket, sizeof(tun->dbuf));
+		if ( len>0 ) len = libssh2_channel_read(tun->channel, tun->dbuf, len);
+		if ( len>0 ) {
+			bucket_Spend(&tun->bucket, len);
+			tun->dlen = len;
+			tun->doff = 0;
+		}
+		else if ( len!=LIBSSH2_ERROR_EAGAIN && len!=0 ) goto shutdown;
 	}
+	if ( tun->dlen>0 ) {				//partial sends keep the rest
+		int i = send(tun_sock, tun->dbuf+tun->doff, tun->dlen, 0);
+		if ( i>0 ) {
+			tun->doff += i;
+			tun->dlen -= i;
+			tun->rx += i;
+			busy++;
+		}
+		else if ( i==0 || WSAGetLastError()!=WSAEWOULDBLOCK ) goto shutdown;
+	}
+	//don't poll for input while it's still waiting for the channel,
+	//poll for output while the socket has data waiting
+	job->events = (tun->buflen>0 ? 0 : POLLRDNORM) | 
+					(tun->dlen>0 ? POLLWRNORM : 0);
+	job->sock = job->events!=0 ? tun_sock : INVALID_SOCKET;
+
+	DWORD now = GetTickCount();
+	if ( now-tun->win_tick>=1000 ) {
+		tun->rate = (int)((tun->tx+tun->rx-tun->win_bytes)*1000
+											/(now-tun->win_tick));
+		tun->win_bytes = tun->tx+tun->rx;
+		tun->win_tick = now;
+	}
+
+	if ( tun->dlen==0 && libssh2_channel_eof(tun->channel) ) goto shutdown;
+	return busy>0 ? 1 : LIBSSH2_ERROR_EAGAIN;
+
+shutdown:							//socket stays open until the channel
+	job->sock = INVALID_SOCKET;		//is freed, tun_del goes by its number
+	if ( tun->closing==0 ) tun->closing = 1;
+	if ( tun->closing==1 ) {			//a cancelled job has no more steps
+		if ( libssh2_channel_close(tun->channel)==LIBSSH2_ERROR_EAGAIN 
+									&& !job->bCancel ) 
+			return LIBSSH2_ERROR_EAGAIN;
+		tun->closing = 2;
+	}
+	if ( libssh2_channel_free(tun->channel)==LIBSSH2_ERROR_EAGAIN 
+									&& !job->bCancel ) 
+		return LIBSSH2_ERROR_EAGAIN;
 	closesocket(tun_sock);
 	tun_del(ph, tun_sock);
 	return 0;
 }
-DWORD WINAPI tun_local(void *pv)
+void tun_accept(SOCKET listensock, void *pv)
+{
+	struct Tunnel *listener = (struct Tunnel *)pv;
+	HOST *ph = listener->host;
+	struct sockaddr_in sin;
+	int sinlen=sizeof(sin);
+	int tun_sock = accept(listensock, (struct sockaddr*)&sin, &sinlen);
+	if ( tun_sock==-1 ) return;
+
+	//channel is opened and relayed by the session owner thread
+	struct Tunnel *tun = tun_new(ph, tun_sock, inet_ntoa(sin.sin_addr),
+					ntohs(sin.sin_port), listener->remoteip, listener->remoteport);
+	if ( tun!=NULL ) {
+		tun->bucket = listener->bucket;
+		tun->parent = listener->socket;
+		listener->accepted++;
+		if ( ssh2_Job(ph, tun_step, tun, FALSE)==0 ) return;
+		tun_free(tun);
+	}
+	closesocket(tun_sock);
+}
+DWORD WINAPI socks_thread(void *pv)		//SOCKS5 handshake of a -D connection
+{
+	struct Tunnel *tun = (struct Tunnel *)pv;
+	SOCKET s = tun->socket;
+	DWORD ms = 10000;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&ms, sizeof(ms));
+
+	unsigned char buf[262];
+	char host[256];
+	if ( !recv_all(s, (char *)buf, 2) || buf[0]!=5 
+		|| !recv_all(s, (char *)buf+2, buf[1]) ) goto fail;
+	send(s, "\005\000", 2, 0);			//no authentication
+	if ( !recv_all(s, (char *)buf, 4) || buf[0]!=5 ) goto fail;
+	switch ( buf[3] ) {
+	case 1:	if ( !recv_all(s, (char *)buf+4, 4) ) goto fail;
+			sprintf(host, "%d.%d.%d.%d", buf[4], buf[5], buf[6], buf[7]);
+			break;
+	case 3: if ( !recv_all(s, (char *)buf+4, 1) 
+				|| !recv_all(s, host, buf[4]) ) goto fail;
+			host[buf[4]] = 0;
+			break;
+	case 4:	if ( !recv_all(s, (char *)buf+4, 16) ) goto fail;
+			inet_ntop(AF_INET6, buf+4, host, sizeof(host));
+			break;
+	default:socks_reply(s, 8);			//address type not supported
+			goto fail;
+	}
+	unsigned char port[2];
+	if ( !recv_all(s, (char *)port, 2) ) goto fail;
+	if ( buf[1]!=1 ) {					//only CONNECT is supported
+		socks_reply(s, 7);
+		goto fail;
+	}
+	ms = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&ms, sizeof(ms));
+	tun->remoteip = strdup(host);
+	tun->remoteport = (port[0]<<8)|port[1];
+	tun->bReply = TRUE;
+	if ( tun->remoteip!=NULL && ssh2_Job(tun->host, tun_step, tun, FALSE)==0 )
+		return 0;
+fail:
+	closesocket(s);
+	tun_free(tun);
+	return 0;
+}
+void socks_accept(SOCKET listensock, void *pv)
+{
+	struct Tunnel *listener = (struct Tunnel *)pv;
+	struct sockaddr_in sin;
+	int sinlen=sizeof(sin);
+	int tun_sock = accept(listensock, (struct sockaddr*)&sin, &sinlen);
+	if ( tun_sock==-1 ) return;
+
+	//handshake on its own thread, the reactor doesn't wait for clients
+	struct Tunnel *tun = tun_new(listener->host, tun_sock, 
+					inet_ntoa(sin.sin_addr), ntohs(sin.sin_port), NULL, 0);
+	if ( tun!=NULL ) {
+		tun->bucket = listener->bucket;
+		tun->parent = listener->socket;
+		listener->accepted++;
+		HANDLE h = CreateThread(NULL, 0, socks_thread, tun, 0, NULL);
+		if ( h!=NULL ) {
+			CloseHandle(h);
+			return;
+		}
+		tun_free(tun);
+	}
+	closesocket(tun_sock);
+}
+DWORD WINAPI rfwd_connect(void *pv)		//-R connection to the local target
+{
+	struct Tunnel *tun = (struct Tunnel *)pv;
+	HOST *ph = tun->host;
+	char port[8];
+	sprintf(port, "%d", tun->localport);
+	SOCKET s = INVALID_SOCKET;
+	struct addrinfo *ainfo;
+	if ( getaddrinfo(tun->localip, port, NULL, &ainfo)==0 ) {
+		s = socket(ainfo->ai_family, SOCK_STREAM, 0);
+		if ( s!=INVALID_SOCKET 
+			&& connect(s, ainfo->ai_addr, ainfo->ai_addrlen)!=0 ) {
+			closesocket(s);
+			s = INVALID_SOCKET;
+		}
+		freeaddrinfo(ainfo);
+	}
+	tun->socket = s;
+	if ( s!=INVALID_SOCKET ) {
+		tun_opened(ph, tun);				//local connect for -R
+		u_long nonblock = 1;
+		ioctlsocket(s, FIONBIO, &nonblock);
+		tun_link(ph, tun);
+	}
+	else
+		term_Print(ph->term, "\r\n\033[31mcouldn't connect to %s:%d\r\n",
+									tun->localip, tun->localport);
+	//the owner relays it, or frees the channel if there's no socket
+	if ( ssh2_Job(ph, tun_step, tun, FALSE)!=0 ) {
+		if ( s!=INVALID_SOCKET ) {
+			closesocket(s);
+			tun_del(ph, s);
+		}
+		else
+			tun_free(tun);
+	}
+	return 0;
+}
+int rfwd_step(HOST *ph, struct Job *job)	//-R listener, on owner thread
+{
+	struct Tunnel *tun = (struct Tunnel *)job->ctx;
+	if ( tun->listener==NULL ) {
+		if ( job->bCancel ) {
+			tun_free(tun);
+			return 0;
+		}
+		int bound = 0;
+		tun->listener = libssh2_channel_forward_listen_ex(ph->session,
+								tun->remoteip, tun->remoteport, &bound, 16);
+		if ( tun->listener==NULL ) {
+			if ( libssh2_session_last_errno(ph->session)==LIBSSH2_ERROR_EAGAIN )
+				return LIBSSH2_ERROR_EAGAIN;
+			term_Print(ph->term, "\r\n\033[31mCouldn't listen on remote port %d\r\n",
+									tun->remoteport);
+			tun_free(tun);
+			return 0;
+		}
+		if ( bound>0 ) tun->remoteport = bound;
+		tun->socket = -tun->remoteport;		//id for !tun to close it
+		tun_link(ph, tun);
+		return 1;
+	}
+	if ( job->bCancel || tun->bClose ) {
+		if ( !job->bCancel && libssh2_channel_forward_cancel(tun->listener)
+									==LIBSSH2_ERROR_EAGAIN ) 
+			return LIBSSH2_ERROR_EAGAIN;
+		tun_del(ph, tun->socket);
+		return 0;
+	}
+	LIBSSH2_CHANNEL *channel = libssh2_channel_forward_accept(tun->listener);
+	if ( channel==NULL ) return LIBSSH2_ERROR_EAGAIN;
+
+	//connect on its own thread, relayed by tun_step once connected
+	struct Tunnel *conn = tun_new(ph, INVALID_SOCKET, tun->localip,
+							tun->localport, tun->remoteip, tun->remoteport);
+	if ( conn!=NULL ) {
+		conn->type = TUN_REMOTE;
+		conn->channel = channel;
+		conn->bucket = tun->bucket;
+		conn->parent = tun->socket;
+		tun->accepted++;
+		HANDLE h = CreateThread(NULL, 0, rfwd_connect, conn, 0, NULL);
+		if ( h!=NULL ) {
+			CloseHandle(h);
+			return 1;
+		}
+		tun_free(conn);
+	}
+	libssh2_channel_free(channel);
+	return 1;
+}
+SOCKET tun_listen(HOST *ph, char *shost, unsigned short sport)
+{
+	struct addrinfo *ainfo;
+	if ( getaddrinfo(shost, NULL, NULL, &ainfo)!=0 ) {
+		term_Print(ph->term, "\r\n\033[31minvalid address: %s\r\n", shost);
+		return INVALID_SOCKET;
+	}
+	int listensock = socket(ainfo->ai_family, SOCK_STREAM, 0);
+	((struct sockaddr_in *)(ainfo->ai_addr))->sin_port = htons(sport);
+	int rc = bind(listensock, ainfo->ai_addr, ainfo->ai_addrlen);
+	freeaddrinfo(ainfo);
+	if ( rc==-1 ) {
+		term_Print(ph->term, "\r\n\033[31mport %d invalid or in use\r\n", sport);
+		closesocket(listensock);
+		return INVALID_SOCKET;
+	}
+	if ( listen(listensock, SOMAXCONN)==-1 ) {
+		term_Print(ph->term, "\r\n\033[31mlisten error\r\n");
+		closesocket(listensock);
+		return INVALID_SOCKET;
+	}
+	return listensock;
+}
+int tun_socks(HOST *ph, char *cmd, int limit)	//-D [host:]port
+{
+	char shost[256] = "127.0.0.1";
+	char *p = strchr(cmd, ':');
+	if ( p!=NULL ) {
+		*p++ = 0;
+		strncpy(shost, cmd, 255); shost[255]=0;
+	}
+	else
+		p = cmd;
+	unsigned short sport = atoi(p);
+	SOCKET listensock = tun_listen(ph, shost, sport);
+	if ( listensock==INVALID_SOCKET ) return -1;
+	struct Tunnel *tun = tun_new(ph, listensock, shost, sport, "*", 0);
+	if ( tun!=NULL ) {
+		tun->type = TUN_SOCKS;
+		bucket_Init(&tun->bucket, limit);
+		tun_link(ph, tun);
+	}
+	if ( tun==NULL || !reactor_Add(listensock, socks_accept, tun) ) {
+		term_Print(ph->term, "\r\n\033[31mtoo many tunnels\r\n");
+		closesocket(listensock);
+		if ( tun!=NULL ) tun_del( ph, listensock);
+		return -1;
+	}
+	return 0;
+}
+int tun_remote(HOST *ph, char *cmd, int limit)	//-R [host:]port host:port
+{
+	char bhost[256] = "localhost", dhost[256];
+	char *p = strchr(cmd, ' ');
+	if ( p==NULL ) return -1;
+	*p++ = 0;
+	strncpy(dhost, p, 255); dhost[255]=0;
+	if ( (p=strchr(dhost, ':'))==NULL ) return -1;
+	*p = 0;
+	unsigned short dport = atoi(++p);
+	if ( (p=strchr(cmd, ':'))!=NULL ) {
+		*p++ = 0;
+		strncpy(bhost, cmd, 255); bhost[255]=0;
+	}
+	else
+		p = cmd;
+	unsigned short rport = atoi(p);
+
+	//the server listens, the owner thread accepts its channels
+	struct Tunnel *tun = tun_new(ph, INVALID_SOCKET, dhost, dport, 
+													bhost, rport);
+	if ( tun==NULL ) return -1;
+	tun->type = TUN_REMOTE;
+	bucket_Init(&tun->bucket, limit);
+	if ( ssh2_Job(ph, rfwd_step, tun, FALSE)!=0 ) {
+		tun_free(tun);
+		return -1;
+	}
+	return 0;
+}
+int tun_local(HOST *ph)
 {
-	HOST *ph = (HOST *)pv;
 	char  *lpath, *rpath;
 	char *cmd = ph->tunline;
+	int limit = 0;
+	if ( strncmp(cmd, "-l ", 3)==0 ) {	//rate limit in Kbit/s
+		limit = atoi(cmd+3);
+		cmd = strchr(cmd+3, ' ');
+		if ( cmd==NULL ) return -1;
+		cmd++;
+	}
+	if ( strncmp(cmd, "-D ", 3)==0 ) return tun_socks(ph, cmd+3, limit);
+	if ( strncmp(cmd, "-R ", 3)==0 ) return tun_remote(ph, cmd+3, limit);
 	char *p = strchr(cmd, ' ');
 	if ( p!=NULL ) {
 		lpath = cmd;
@@ -897,8 +2696,8 @@ DWORD WINAPI tun_local(void *pv)
 	else
 		return 0;
 
-	char shost[256], dhost[256], *client_host;
-	unsigned short sport, dport, client_port;
+	char shost[256], dhost[256];
+	unsigned short sport, dport;
 
 	strncpy(shost, lpath, 255); shost[255]=0;
 	strncpy(dhost, rpath, 255); dhost[255]=0;
@@ -907,57 +2706,113 @@ DWORD WINAPI tun_local(void *pv)
 	if ( (p=strchr(dhost, ':'))==NULL ) return -1;
 	*p = 0; dport = atoi(++p);
 
-	struct sockaddr_in sin;
-	int sinlen=sizeof(sin);
-	struct addrinfo *ainfo;
-	if ( getaddrinfo(shost, NULL, NULL, &ainfo)!=0 ) {
-		term_Print(ph->term, "\r\n\033[31minvalid address: %s\r\n", shost);
+	SOCKET listensock = tun_listen(ph, shost, sport);
+	if ( listensock==INVALID_SOCKET ) return -1;
+	struct Tunnel *tun = tun_add( ph, listensock, NULL,
+										shost, sport, dhost, dport);
+	if ( tun!=NULL ) bucket_Init(&tun->bucket, limit);
+	if ( tun==NULL || !reactor_Add(listensock, tun_accept, tun) ) {
+		term_Print(ph->term, "\r\n\033[31mtoo many tunnels\r\n");
+		closesocket(listensock);
+		tun_del( ph, listensock);
 		return -1;
 	}
-	int listensock = socket(ainfo->ai_family, SOCK_STREAM, 0);
-	((struct sockaddr_in *)(ainfo->ai_addr))->sin_port = htons(sport);
-	int rc = bind(listensock, ainfo->ai_addr, ainfo->ai_addrlen);
-	freeaddrinfo(ainfo);
-	if ( rc==-1 ) {
-		term_Print(ph->term, "\r\n\033[31mport %d invalid or in use\r\n", sport);
-		closesocket(listensock);
+	return 0;
+}
+/*******************************ProxyJump*******************************/
+HOST *jump_Bastion(HOST *ph, char *bastion)
+{
+	char host[256];
+	strncpy(host, bastion, 255);
+	host[255] = 0;
+	char *p = strchr(host, '@');
+	if ( p!=NULL ) strcpy(host, p+1);
+	short port = 22;
+	p = strchr(host, ':');
+	if ( p!=NULL ) {
+		*p++ = 0;
+		port = atoi(p);
+	}
+
+	HOST *outer = NULL;					//referenced, see session_Find
+	if ( WaitForSingleObject(mtx_jump, INFINITE)==WAIT_OBJECT_0 ) {
+		outer = session_Find(host, port);
+		for ( int id=1; outer==NULL && id<MAXSESSIONS; id++ ) {
+			TERM *pt = session_Get(id, FALSE);
+			if ( pt!=NULL ) {
+				session_Put(pt);
+				continue;
+			}
+			pt = session_Get(id, TRUE);			//headless, key or agent auth
+			if ( pt==NULL ) break;
+			char cmd[256];
+			snprintf(cmd, sizeof(cmd), "ssh %s", bastion);
+			term_Print(ph->term, "opening %s in session %d...", host, id);
+			pt->host->bBatch = TRUE;		//key or agent auth only
+			host_Open(pt->host, cmd);
+			for ( int i=0; i<300; i++ ) {
+				Sleep(100);
+				int status = host_Status(pt->host);
+				if ( status==CONNECTED ) break;
+				if ( status==IDLE && i>=10 ) break;
+			}
+			outer = session_Find(host, port);
+			session_Put(pt);
+			if ( outer==NULL ) session_Free(id);
+			break;
+		}
+		ReleaseMutex(mtx_jump);
+	}
+	return outer;
+}
+int ssh_jump(HOST *ph)		//connect over a direct-tcpip channel of a bastion
+{
+	HOST *outer = jump_Bastion(ph, ph->jumphost);
+	if ( outer==NULL ) {
+		term_Error(ph->term, "bastion not connected");
 		return -1;
 	}
-	if ( listen(listensock, 2)==-1 ) {
-		term_Print(ph->term, "\r\n\033[31mlisten error\r\n");
-		closesocket(listensock);
+	term_Print(ph->term, "Jumping via %s...", outer->hostname);
+	TERM *bastion = outer->term;
+
+	//loopback pair, inner session on one end, bastion relays the other
+	struct sockaddr_in sin;
+	int sinlen = sizeof(sin);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	SOCKET listensock = socket(AF_INET, SOCK_STREAM, 0);
+	SOCKET s0 = INVALID_SOCKET, s1 = INVALID_SOCKET;
+	if ( bind(listensock, (struct sockaddr *)&sin, sizeof(sin))==0
+		&& listen(listensock, 1)==0
+		&& getsockname(listensock, (struct sockaddr *)&sin, &sinlen)==0 ) {
+		s0 = socket(AF_INET, SOCK_STREAM, 0);
+		if ( connect(s0, (struct sockaddr *)&sin, sizeof(sin))==0 ) {
+			sinlen = sizeof(sin);
+			s1 = accept(listensock, (struct sockaddr *)&sin, &sinlen);
+		}
+	}
+	closesocket(listensock);
+	if ( s1==INVALID_SOCKET ) {
+		term_Error(ph->term, "loopback failure");
+		if ( s0!=INVALID_SOCKET ) closesocket(s0);
+		session_Put(bastion);
 		return -1;
 	}
-	tun_add( ph, listensock, NULL, shost, sport, dhost, dport);
-
-	int tun_sock;
-	LIBSSH2_CHANNEL *tun_channel=NULL;
-	while ((tun_sock=accept(listensock,(struct sockaddr*)&sin,&sinlen))!=-1) {
-		client_host = inet_ntoa(sin.sin_addr);
-		client_port = ntohs(sin.sin_port);
-		do {
-			int rc = 0;
-			if ( WaitForSingleObject(ph->mtx, INFINITE)==WAIT_OBJECT_0 ) {
-				tun_channel = libssh2_channel_direct_tcpip_ex(ph->session,
-										dhost, dport, client_host, client_port);
-				if (!tun_channel) rc = libssh2_session_last_errno(ph->session);
-				ReleaseMutex(ph->mtx);
-			}
-			if ( !tun_channel ) {
-				if ( rc!=LIBSSH2_ERROR_EAGAIN || ssh_wait_socket(ph)<0 ) {
-					term_Print(ph->term, "\033[31mCouldn't tunnel, is it supported?\r\n");
-					closesocket(tun_sock);
-					goto shutdown;
-				}
-			}
-		} while ( !tun_channel);
-		void *tun = tun_add( ph, tun_sock, tun_channel,
-								client_host, client_port, dhost, dport);
-		CreateThread( NULL, 0, tun_worker, tun, 0, NULL);
+
+	//relayed and counted like a -L connection in the bastion's !tun list
+	struct Tunnel *tun = tun_new(outer, s1, "127.0.0.1", ntohs(sin.sin_port),
+										ph->hostname, ph->port);
+	if ( tun==NULL || ssh2_Job(outer, tun_step, tun, FALSE)!=0 ) {
+		if ( tun!=NULL ) tun_free(tun);
+		closesocket(s1);
+		closesocket(s0);
+		term_Error(ph->term, "bastion busy");
+		session_Put(bastion);
+		return -1;
 	}
-shutdown:
-	closesocket(listensock);
-	tun_del( ph, listensock);
+	session_Put(bastion);				//tunnel lives on the bastion's thread
+	ph->sock = s0;
 	return 0;
 }
 void ssh2_Tun(HOST *ph, char *cmd)
@@ -965,36 +2820,63 @@ void ssh2_Tun(HOST *ph, char *cmd)
 	if ( *cmd==' ' ) {
 		char *p = strchr(++cmd, ' ');
 		if ( p!=NULL ) {				//close a tunnel
-			DWORD dwTunnelId;			//open new tunnel
-			strncpy(ph->tunline, cmd, 255);
+			strncpy(ph->tunline, cmd, 255);	//open new tunnel
 			ph->tunline[255] = 0;
 			term_Print(ph->term, "tunnel:%s\r\n", ph->tunline);
-			CreateThread( NULL, 0, tun_local, ph, 0, &dwTunnelId);
-			Sleep(100);
+			tun_local(ph);
 		}
 		else {
 			int sock = atoi(cmd);
-			struct Tunnel *tun = ph->tunnel_list;
-			while ( tun!=NULL ) {
-				if ( tun->socket==sock ) closesocket(sock);
-				tun = tun->next;
+			if ( WaitForSingleObject(ph->mtx_tun, INFINITE)==WAIT_OBJECT_0 ) {
+				struct Tunnel *tun = ph->tunnel_list;
+				while ( tun!=NULL ) {
+					if ( tun->socket==sock ) {
+						tun_close(ph, tun);
+						break;
+					}
+					tun = tun->next;
+				}
+				ReleaseMutex(ph->mtx_tun);
 			}
 		}
 	}
 	else {								//list existing tunnels
-		struct Tunnel *tun = ph->tunnel_list;
 		int listen_cnt = 0, active_cnt = 0;
 		term_Print(ph->term, "\r\nTunnels:\r\n");
-		while ( tun!=NULL ) {
-			term_Print(ph->term, tun->channel==NULL?"listen":"active");
-			term_Print(ph->term, " socket %d\t%s:%d\t%s:%d\r\n",
+		const char *listens[] = {"listen", "remote", "socks"};
+		if ( WaitForSingleObject(ph->mtx_tun, INFINITE)==WAIT_OBJECT_0 ) {
+			DWORD now = GetTickCount();
+			struct Tunnel *tun, *conn;
+			for ( tun=ph->tunnel_list; tun!=NULL; tun=tun->next ) {
+				term_Print(ph->term, tun->channel==NULL ? listens[tun->type] 
+														: "active");
+				term_Print(ph->term, " socket %d\t%s:%d\t%s:%d\r\n",
 								tun->socket, tun->localip, tun->localport,
 								tun->remoteip, tun->remoteport);
-			if ( tun->channel!=NULL )
-				active_cnt++;
-			else
+				if ( tun->channel!=NULL ) {	//tx is into ssh, rx out of it
+					active_cnt++;
+					term_Print(ph->term, "\ttx %lldKB rx %lldKB, %dKB/s, "
+						"open %lums, up %lus\r\n", tun->tx>>10, tun->rx>>10,
+						now-tun->win_tick<2000 ? tun->rate>>10 : 0,
+						tun->open_ms, (now-tun->start)/1000);
+					continue;
+				}
 				listen_cnt++;
-			tun = tun->next;
+				long long tx = tun->tx, rx = tun->rx;
+				int active = 0, rate = 0;
+				for ( conn=ph->tunnel_list; conn!=NULL; conn=conn->next ) {
+					if ( conn->parent!=tun->socket ) continue;
+					active++;
+					tx += conn->tx;
+					rx += conn->rx;
+					if ( now-conn->win_tick<2000 ) rate += conn->rate;
+				}
+				term_Print(ph->term, "\t%d accepted, %d active, tx %lldKB "
+						"rx %lldKB, %dKB/s, open avg %lums\r\n", 
+						tun->accepted, active, tx>>10, rx>>10, rate>>10,
+						tun->opened ? tun->open_ms/tun->opened : 0);
+			}
+			ReleaseMutex(ph->mtx_tun);
 		}
 		term_Print(ph->term, "\t%d listenning, %d active\r\n", 
 							listen_cnt, active_cnt);
@@ -1002,6 +2884,393 @@ void ssh2_Tun(HOST *ph, char *cmd)
 	ssh2_Send( ph, "\r", 1);
 }
 /*******************sftpHost*******************************/
+#define SFTP_PROMPT "\033[32msftp> \033[37m"
+#define RDIR_TTL 30000				//ms a cached remote listing is used
+#define RDIR_CHILDREN 32			//sub directories prefetched after cd
+#define RDIR_MAX 256				//listings kept
+#define RDIR_NAMES 262144			//names kept, in all listings
+struct rdir {						//remote directory listing, sftp sessions
+	char *path;
+	DWORD tick;						//when it was read
+	BOOL bStale;					//changed by us, read it again
+	char *arena;					//type, name and long entry, back to back
+	char **names;					//sorted, type is the byte before name
+	int count;
+	struct rdir *next;
+};
+//entries are only freed while holding mtx_sftp and mtx_rdir, so 
+//the sftp thread and prefetch can use them after mtx_rdir is released
+void rpath_Norm(const char *path, char *out)	//collapse //, /./ and /x/..
+{
+	*out = 0;
+	while ( *path ) {
+		while ( *path=='/' ) path++;
+		const char *e = strchr(path, '/');
+		if ( e==NULL ) e = path+strlen(path);
+		int n = e-path;
+		if ( n==2 && path[0]=='.' && path[1]=='.' ) {
+			char *p = strrchr(out, '/');
+			if ( p!=NULL ) *p = 0;
+		}
+		else if ( n>0 && (n!=1 || *path!='.') && strlen(out)+n<1022 ) {
+			strcat(out, "/");
+			strncat(out, path, n);
+		}
+		path = e;
+	}
+	if ( *out==0 ) strcpy(out, "/");
+}
+int rdir_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+void rdir_Free(struct rdir *d)
+{
+	free(d->path);
+	free(d->arena);
+	free(d->names);
+	free(d);
+}
+struct rdir_job {
+	HOST *ph;
+	LONG gen;						//a newer prefetch stops this one
+	BOOL bChildren;
+	char path[1024];
+};
+BOOL rdir_Current(struct rdir_job *job)
+{
+	return job->ph->sftp_running && job->ph->rdir_gen==job->gen;
+}
+//prefetch gives way to a newer prefetch or a command waiting for mtx_sftp
+BOOL rdir_Go(struct rdir_job *job)
+{
+	return job->ph->sftp_running && job->ph->rdir_gen==job->gen
+									&& job->ph->sftp_waiting==0;
+}
+//holding mtx_sftp, job is the prefetch reading it, NULL for the sftp thread
+struct rdir *rdir_Read(HOST *ph, const char *path, struct rdir_job *job)
+{
+	LIBSSH2_SFTP_HANDLE *sftp_handle = libssh2_sftp_opendir(ph->sftp, path);
+	if ( sftp_handle==NULL ) return NULL;
+	struct rdir *d = (struct rdir *)malloc(sizeof(struct rdir));
+	if ( d==NULL ) {
+		libssh2_sftp_closedir(sftp_handle);
+		return NULL;
+	}
+	memset(d, 0, sizeof(struct rdir));
+	d->path = strdup(path);
+	d->tick = GetTickCount();
+
+	size_t used = 0, size = 0;
+	size_t *idx = NULL;				//offsets, arena moves as it grows
+	int max_count = 0;
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	char mem[512], longentry[1024];
+	BOOL bAbort = FALSE;
+	while ( libssh2_sftp_readdir_ex(sftp_handle, mem, sizeof(mem),
+								longentry, sizeof(longentry), &attrs)>0 ) {
+		if ( job!=NULL && (d->count&63)==63 && !rdir_Go(job) ) {
+			bAbort = TRUE;				//partial listing is of no use
+			break;
+		}
+		size_t nlen = strlen(mem)+1, llen = strlen(longentry)+1;
+		if ( used+1+nlen+llen>size ) {
+			size_t newsize = size==0 ? 65536 : size*2;
+			char *p = (char *)realloc(d->arena, newsize);
+			if ( p==NULL ) break;
+			d->arena = p;
+			size = newsize;
+		}
+		if ( d->count==max_count ) {
+			int newmax = max_count==0 ? 1024 : max_count*2;
+			size_t *p = (size_t *)realloc(idx, newmax*sizeof(size_t));
+			if ( p==NULL ) break;
+			idx = p;
+			max_count = newmax;
+		}
+		BOOL bDir = (attrs.flags&LIBSSH2_SFTP_ATTR_PERMISSIONS) &&
+					LIBSSH2_SFTP_S_ISDIR(attrs.permissions);
+		d->arena[used++] = bDir ? 'd' : '-';
+		idx[d->count++] = used;
+		memcpy(d->arena+used, mem, nlen);
+		memcpy(d->arena+used+nlen, longentry, llen);
+		used += nlen+llen;
+	}
+	libssh2_sftp_closedir(sftp_handle);
+
+	if ( d->count>0 ) d->names = (char **)malloc(d->count*sizeof(char *));
+	if ( bAbort || d->path==NULL || (d->count>0 && d->names==NULL) ) {
+		free(idx);
+		rdir_Free(d);
+		return NULL;
+	}
+	for ( int i=0; i<d->count; i++ ) d->names[i] = d->arena+idx[i];
+	qsort(d->names, d->count, sizeof(char *), rdir_cmp);
+	free(idx);
+	return d;
+}
+struct rdir *rdir_Fresh(HOST *ph, const char *key)	//holding mtx_rdir
+{
+	struct rdir *d;
+	for ( d=ph->rdir_list; d!=NULL; d=d->next ) 
+		if ( !d->bStale && GetTickCount()-d->tick<RDIR_TTL 
+				&& strcmp(d->path, key)==0 ) break;
+	return d;
+}
+struct rdir *rdir_Find(HOST *ph, const char *path)	//fresh listing or NULL
+{
+	char key[1024];
+	rpath_Norm(path, key);
+	struct rdir *d = NULL;
+	if ( WaitForSingleObject(ph->mtx_rdir, INFINITE)==WAIT_OBJECT_0 ) {
+		d = rdir_Fresh(ph, key);
+		ReleaseMutex(ph->mtx_rdir);
+	}
+	return d;
+}
+//holding mtx_sftp, old, stale and replaced listings are let go, and the
+//oldest ones past RDIR_MAX listings or RDIR_NAMES names in all
+void rdir_Add(HOST *ph, struct rdir *d)
+{
+	if ( WaitForSingleObject(ph->mtx_rdir, INFINITE)==WAIT_OBJECT_0 ) {
+		d->next = ph->rdir_list;
+		ph->rdir_list = d;
+		int listings = 1, names = d->count;
+		struct rdir **pp = &d->next;
+		while ( *pp!=NULL ) {
+			struct rdir *e = *pp;
+			if ( e->bStale || GetTickCount()-e->tick>=RDIR_TTL 
+				|| strcmp(e->path, d->path)==0 
+				|| listings>=RDIR_MAX || names+e->count>RDIR_NAMES ) {
+				*pp = e->next;
+				rdir_Free(e);
+			}
+			else {
+				listings++;
+				names += e->count;
+				pp = &e->next;
+			}
+		}
+		ReleaseMutex(ph->mtx_rdir);
+	}
+}
+struct rdir *rdir_Get(HOST *ph, const char *path)	//sftp thread only
+{
+	struct rdir *d = rdir_Find(ph, path);
+	if ( d==NULL ) {
+		char key[1024];
+		rpath_Norm(path, key);
+		d = rdir_Read(ph, key, NULL);
+		if ( d!=NULL ) rdir_Add(ph, d);
+	}
+	return d;
+}
+char **rdir_Lookup(struct rdir *d, const char *name)
+{
+	return (char **)bsearch(&name, d->names, d->count, sizeof(char *), rdir_cmp);
+}
+void rdir_Drop(HOST *ph, const char *path)	//we changed path, NULL for all
+{
+	char key[1024] = "", parent[1024] = "";
+	if ( path!=NULL ) {
+		rpath_Norm(path, key);
+		strcpy(parent, key);
+		char *p = strrchr(parent, '/');
+		if ( p!=NULL ) p[p==parent ? 1 : 0] = 0;
+	}
+	int len = strlen(key);
+	if ( WaitForSingleObject(ph->mtx_rdir, INFINITE)==WAIT_OBJECT_0 ) {
+		for ( struct rdir *d=ph->rdir_list; d!=NULL; d=d->next ) {
+			if ( path==NULL || strcmp(d->path, parent)==0 
+				|| (strncmp(d->path, key, len)==0 
+					&& (d->path[len]==0 || d->path[len]=='/')) )
+				d->bStale = TRUE;
+		}
+		ReleaseMutex(ph->mtx_rdir);
+	}
+}
+void rdir_Close(HOST *ph)				//session is gone
+{
+	while ( ph->rdir_threads>0 ) Sleep(10);
+	while ( ph->rdir_list!=NULL ) {
+		struct rdir *d = ph->rdir_list;
+		ph->rdir_list = d->next;
+		rdir_Free(d);
+	}
+}
+void rdir_Fill(struct rdir_job *job, const char *path, char **children)
+{
+	HOST *ph = job->ph;
+	if ( WaitForSingleObject(ph->mtx_sftp, INFINITE)==WAIT_OBJECT_0 ) {
+		if ( rdir_Go(job) ) {
+			struct rdir *d = rdir_Find(ph, path);
+			if ( d==NULL ) {
+				d = rdir_Read(ph, path, job);
+				if ( d!=NULL ) rdir_Add(ph, d);
+			}
+			for ( int i=0, n=0; children!=NULL && d!=NULL 
+								&& i<d->count && n<RDIR_CHILDREN; i++ ) {
+				char *name = d->names[i];
+				if ( name[-1]!='d' || strcmp(name, ".")==0 
+								|| strcmp(name, "..")==0 ) continue;
+				children[n] = (char *)malloc(strlen(path)+strlen(name)+2);
+				if ( children[n]==NULL ) break;
+				sprintf(children[n++], "%s%s%s", path, 
+							path[strlen(path)-1]=='/' ? "" : "/", name);
+			}
+		}
+		ReleaseMutex(ph->mtx_sftp);
+	}
+}
+DWORD WINAPI rdir_thread(void *pv)		//read listings ahead of the user
+{
+	struct rdir_job *job = (struct rdir_job *)pv;
+	char *children[RDIR_CHILDREN];
+	memset(children, 0, sizeof(children));
+	rdir_Fill(job, job->path, job->bChildren ? children : NULL);
+	for ( int i=0; i<RDIR_CHILDREN && children[i]!=NULL; i++ ) {
+		while ( rdir_Current(job) && job->ph->sftp_waiting>0 ) Sleep(10);
+		if ( rdir_Current(job) ) rdir_Fill(job, children[i], NULL);
+		free(children[i]);
+	}
+	InterlockedDecrement(&job->ph->rdir_threads);
+	free(job);
+	return 0;
+}
+void rdir_Prefetch(HOST *ph, const char *path, BOOL bChildren)
+{
+	struct rdir_job *job = (struct rdir_job *)malloc(sizeof(struct rdir_job));
+	if ( job==NULL ) return;
+	job->ph = ph;
+	job->gen = InterlockedIncrement(&ph->rdir_gen);
+	job->bChildren = bChildren;
+	rpath_Norm(path, job->path);
+	InterlockedIncrement(&ph->rdir_threads);
+	HANDLE h = CreateThread(NULL, 0, rdir_thread, job, 0, NULL);
+	if ( h!=NULL ) 
+		CloseHandle(h);
+	else {
+		InterlockedDecrement(&ph->rdir_threads);
+		free(job);
+	}
+}
+BOOL rdir_Local(const char *cmd, int arg)	//argument is a local path
+{
+	if ( strncmp(cmd, "lcd", 3)==0 ) return TRUE;
+	if ( arg==1 ) return strncmp(cmd, "put", 3)==0 
+					|| strncmp(cmd, "reput", 5)==0 
+					|| strncmp(cmd, "syncput", 7)==0;
+	return strncmp(cmd, "get", 3)==0 || strncmp(cmd, "reget", 5)==0 
+		|| (strncmp(cmd, "sync", 4)==0 && strncmp(cmd, "syncput", 7)!=0);
+}
+//tab at the sftp prompt, completes remote names from cached listings only,
+//a directory not listed yet is prefetched for the next tab
+void rdir_Complete(HOST *ph)
+{
+	char line[256], word[256], dir[1024], key[1024], add[512], list[2048];
+	ph->keys[ph->cursor] = 0;
+	strcpy(line, ph->keys);
+	int arg = 0;
+	char *start = line;
+	for ( char *p=line; *p; p++ ) {
+		if ( *p==' ' && (p==line || p[-1]!='\\') ) {
+			start = p+1;
+			if ( p[1]!=' ' ) arg++;
+		}
+	}
+	if ( arg==0 || rdir_Local(line, arg) ) return;
+
+	int len = 0;
+	for ( char *p=start; *p; p++ )
+		if ( *p!='\\' || p[1]!=' ' ) word[len++] = *p;
+	word[len] = 0;
+	char *prefix = strrchr(word, '/');
+	if ( prefix!=NULL ) *prefix++ = 0; else prefix = word;
+	if ( *word=='/' || (prefix!=word && *word==0) ) 
+		strcpy(dir, *word ? word : "/");
+	else {
+		strcpy(dir, ph->realpath);
+		if ( prefix!=word ) {
+			strcat(dir, "/");
+			strcat(dir, word);
+		}
+	}
+	rpath_Norm(dir, key);
+
+	int plen = strlen(prefix), n = 0, common = 0, listed = 0;
+	BOOL bDir = FALSE, bFound = FALSE;
+	*add = 0;
+	*list = 0;
+	if ( WaitForSingleObject(ph->mtx_rdir, INFINITE)==WAIT_OBJECT_0 ) {
+		struct rdir *d = rdir_Fresh(ph, key);
+		if ( d!=NULL ) {
+			bFound = TRUE;
+			int lo = 0, hi = d->count;		//first name not below prefix
+			while ( lo<hi ) {
+				int mid = (lo+hi)/2;
+				if ( strcmp(d->names[mid], prefix)<0 ) lo = mid+1;
+				else hi = mid;
+			}
+			for ( int i=lo; i<d->count; i++ ) {
+				char *name = d->names[i];
+				if ( strncmp(name, prefix, plen)!=0 ) break;
+				if ( strcmp(name, ".")==0 || strcmp(name, "..")==0 ) continue;
+				if ( n++==0 ) {
+					strncpy(add, name, 255);
+					add[255] = 0;
+					common = strlen(add);
+					bDir = name[-1]=='d';
+				}
+				else {
+					int k = plen;
+					while ( k<common && name[k]==add[k] ) k++;
+					common = k;
+				}
+				if ( listed+strlen(name)+3<sizeof(list) ) {
+					strcat(list, name);
+					strcat(list, "  ");
+					listed += strlen(name)+2;
+				}
+			}
+		}
+		ReleaseMutex(ph->mtx_rdir);
+	}
+	if ( !bFound ) {
+		rdir_Prefetch(ph, key, FALSE);
+		return;
+	}
+	if ( n==0 ) return;
+	if ( n>1 && common==plen ) {			//nothing to add, show choices
+		term_Print(ph->term, "\r\n%s\r\n", list);
+		term_Disp(ph->term, SFTP_PROMPT);
+		term_Parse(ph->term, ph->keys, ph->cursor);
+		return;
+	}
+	add[common] = 0;
+	if ( n==1 ) strcat(add, bDir ? "/" : " ");
+	for ( char *p=add+plen; *p && ph->cursor<254; p++ ) {
+		if ( *p==' ' && p[1]!=0 ) ph->keys[ph->cursor++] = '\\';
+		ph->keys[ph->cursor++] = *p;
+	}
+	ph->keys[ph->cursor] = 0;
+	len = strlen(line);
+	term_Parse(ph->term, ph->keys+len, ph->cursor-len);
+}
+BOOL rdir_IsDir(HOST *ph, const char *path, char *realpath)
+{
+	if ( *path!='/' ) return FALSE;
+	rpath_Norm(path, realpath);
+	if ( rdir_Find(ph, realpath)!=NULL ) return TRUE;
+	char parent[1024];
+	strcpy(parent, realpath);
+	char *name = strrchr(parent, '/');
+	if ( name==NULL || name[1]==0 ) return FALSE;
+	*name++ = 0;
+	struct rdir *d = rdir_Find(ph, *parent ? parent : "/");
+	if ( d==NULL ) return FALSE;
+	char **p = rdir_Lookup(d, name);
+	return p!=NULL && (*p)[-1]=='d';	//symbolic links are left to realpath
+}
 void sftp_lcd(HOST *ph, char *cmd)
 {
 	char buf[4096];
@@ -1017,7 +3286,9 @@ void sftp_cd(HOST *ph, char *path)
 	char newpath[1024];
 	if ( path!=NULL ) {
 		LIBSSH2_SFTP_HANDLE *sftp_handle;
-		if ( (sftp_handle=libssh2_sftp_opendir(ph->sftp, path))!=NULL ) {
+		if ( rdir_IsDir(ph, path, newpath) ) 	//no round trip if listed
+			strcpy(ph->realpath, newpath);
+		else if ( (sftp_handle=libssh2_sftp_opendir(ph->sftp, path))!=NULL ) {
 			libssh2_sftp_closedir(sftp_handle);
 			if ( libssh2_sftp_realpath(ph->sftp, path, newpath, 1024)>0 ) 
 				strcpy(ph->realpath, newpath);
@@ -1025,13 +3296,29 @@ void sftp_cd(HOST *ph, char *path)
 		else {
 			term_Print(ph->term, "\033[31mCouldn't change dir to %s\r\n",path);
 		}
+		rdir_Prefetch(ph, ph->realpath, TRUE);
 	}
 	term_Print(ph->term, "\033[32m%s\033[37m\r\n", ph->realpath);
 }
-void sftp_ls(HOST *ph, char *path, int ll)
+enum lsOptions {LS_LONG=1, LS_UNSORTED=2, LS_PAGED=4};
+struct ls_page {					//output of ls/dir, a screen at a time
+	HOST *ph;
+	int lines, rows;
+	BOOL bPaged;
+};
+BOOL ls_print(struct ls_page *pg, const char *line)	//FALSE if user quits
+{
+	term_Print(pg->ph->term, "%s\r\n", line);
+	if ( pg->bPaged && ++pg->lines>=pg->rows ) {
+		pg->lines = 0;
+		char *key = ssh2_Gets(pg->ph, "\033[7m--More--\033[0m", TRUE);
+		term_Disp(pg->ph->term, "\033[A\r\033[K");
+		if ( key==NULL || *key=='q' ) return FALSE;
+	}
+	return TRUE;
+}
+void ls_stream(HOST *ph, char *path, int opts, struct ls_page *pg)
 {
-	if ( WaitForSingleObject(ph->mtx, INFINITE)!=WAIT_OBJECT_0 ) return;
-
 	LIBSSH2_SFTP_HANDLE *sftp_handle = libssh2_sftp_opendir(ph->sftp, path);
 	char *pattern = NULL;
 	if ( sftp_handle==NULL ) {
@@ -1043,46 +3330,53 @@ void sftp_ls(HOST *ph, char *path, int ll)
 		pattern++;
 		sftp_handle = libssh2_sftp_opendir(ph->sftp, path);
 	}
-	if ( sftp_handle!=NULL ) {
-		LIBSSH2_SFTP_ATTRIBUTES attrs;
-		int count = 0;
-		char mem[256], longentry[256];
-		char *shortlist[256], *longlist[256];
-		while ( libssh2_sftp_readdir_ex(sftp_handle, mem, sizeof(mem),
+	if ( sftp_handle==NULL ) {
+		term_Print(ph->term, "\033[31mCouldn't open dir %s\r\n", path);
+		return;
+	}
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	char mem[512], longentry[1024];
+	while ( libssh2_sftp_readdir_ex(sftp_handle, mem, sizeof(mem),
 								longentry, sizeof(longentry), &attrs)>0 ) {
-			if ( pattern==NULL || fnmatch(pattern, mem, 0)==0 ) {
-				int i;
-				for ( i=0; i<count; i++ ) {
-					if ( strcmp(mem, shortlist[i])<0 ) {
-						for ( int j=254; j>i; j-- ) {
-							shortlist[j] = shortlist[j-1];
-							longlist[j] = longlist[j-1];
-						}
-						shortlist[i] = strdup(mem);
-						longlist[i] = strdup(longentry);
-						break;
-					}
-				}
-				if ( i==count ) {
-					shortlist[i] = strdup(mem);
-					longlist[i] = strdup(longentry);
-				}
-				if ( ++count==256 ) break;
-			}
-		}
-		for (int i=0; i<count; i++ ) {
-			term_Print(ph->term, "%s\r\n", ll ? longlist[i] : shortlist[i]);
-			free(longlist[i]); free(shortlist[i]);
-		}	
-		libssh2_sftp_closedir(sftp_handle);
+		if ( pattern!=NULL && fnmatch(pattern, mem, 0)!=0 ) continue;
+		if ( !ls_print(pg, (opts&LS_LONG) ? longentry : mem) ) break;
 	}
-	else {
+	libssh2_sftp_closedir(sftp_handle);
+}
+void sftp_ls(HOST *ph, char *path, int opts)
+{
+	struct ls_page pg = { ph, 0, max(ph->term->size_y-1, 1), 
+							(opts&LS_PAGED)!=0 };
+	char *pattern = NULL;
+	struct rdir *d = rdir_Find(ph, path);
+	if ( d==NULL && (opts&LS_UNSORTED) ) {	//shown as entries arrive
+		ls_stream(ph, path, opts, &pg);
+		return;
+	}
+	if ( d==NULL ) d = rdir_Get(ph, path);
+	if ( d==NULL ) {
+		pattern = strrchr(path, '/');
+		if ( pattern!=path )
+			*pattern = 0;
+		else
+			path = "/";
+		pattern++;
+		d = rdir_Get(ph, path);
+	}
+	if ( d==NULL ) {
 		term_Print(ph->term, "\033[31mCouldn't open dir %s\r\n", path);
+		return;
+	}
+	for ( int i=0; i<d->count; i++ ) {
+		char *name = d->names[i];
+		if ( pattern!=NULL && fnmatch(pattern, name, 0)!=0 ) continue;
+		if ( !ls_print(&pg, (opts&LS_LONG) ? name+strlen(name)+1 : name) )
+			break;
 	}
-	ReleaseMutex(ph->mtx);
 }
 void sftp_rm(HOST *ph, char *path)
 {
+	rdir_Drop(ph, path);
 	if ( strchr(path, '*')==NULL && strchr(path, '?')==NULL ) {
 		if ( libssh2_sftp_unlink(ph->sftp, path) )
 			term_Print(ph->term, "\033[31mcouldn't delete %s\r\n", path);
@@ -1112,6 +3406,7 @@ void sftp_rm(HOST *ph, char *path)
 }
 void sftp_md(HOST *ph, char *path)
 {
+	rdir_Drop(ph, path);
 	int rc = libssh2_sftp_mkdir(ph->sftp, path,
 							LIBSSH2_SFTP_S_IRWXU|
 							LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IXGRP|
@@ -1122,15 +3417,122 @@ void sftp_md(HOST *ph, char *path)
 }
 void sftp_rd(HOST *ph, char *path)
 {
+	rdir_Drop(ph, path);
 	if ( libssh2_sftp_rmdir(ph->sftp, path) )
 		term_Print(ph->term, "\033[31mcouldn't remove dir \033[32m%s\r\n", path);
 }
 void sftp_ren(HOST *ph, char *src, char *dst)
 {
+	rdir_Drop(ph, src);
+	rdir_Drop(ph, dst);
 	if ( libssh2_sftp_rename(ph->sftp, src, dst) )
 		term_Print(ph->term, "\033[31mcouldn't rename file\033[32m%s\r\n", src);
 }
-void sftp_get_one(HOST *ph, char *src, char *dst)
+int sftp_exec(HOST *ph, const char *cmd, char *out, int size)
+{
+	int len = 0, rc;
+	LIBSSH2_CHANNEL *channel = libssh2_channel_open_session(ph->session);
+	if ( channel==NULL ) return -1;
+	if ( libssh2_channel_exec(channel, cmd)==0 ) 
+		while ( len<size-1 && (rc=libssh2_channel_read(channel, out+len,
+													size-1-len))>0 ) 
+			len += rc;
+	out[len] = 0;
+	libssh2_channel_close(channel);
+	libssh2_channel_free(channel);
+	return len;
+}
+//copy on the server, so the data doesn't cross the link twice. libssh2 has
+//no call for the copy-data extension, cp is run on an exec channel instead
+void sftp_cp(HOST *ph, char *src, char *dst)
+{
+	char cmd[8400], out[1024];
+	int len = sprintf(cmd, "cp -p ");
+	len += sh_quote(cmd+len, src);
+	cmd[len++] = ' ';
+	len += sh_quote(cmd+len, dst);
+	strcpy(cmd+len, " 2>&1 && echo copied");
+
+	term_Print(ph->term, "cp %s\t\t\t", dst);
+	DWORD start = GetTickCount();
+	if ( sftp_exec(ph, cmd, out, sizeof(out))<0 ) 
+		strcpy(out, "couldn't open exec channel");
+	rdir_Drop(ph, dst);
+	len = strlen(out);
+	while ( len>0 && (out[len-1]=='\n' || out[len-1]=='\r') ) out[--len] = 0;
+	if ( strcmp(out, "copied")==0 ) 
+		term_Print(ph->term, "copied in %lums\r\n", GetTickCount()-start);
+	else
+		term_Print(ph->term, "\033[31m%s\r\n", out);
+}
+#define SFTP_READ_SIZE 30000		//largest read request libssh2 sends
+void sftp_window(HOST *ph, char *n)
+{
+	if ( *n ) {
+		int window = atoi(n);
+		if ( window>0 && window<=1024 ) 
+			ph->sftp_window = window;
+		else
+			term_Print(ph->term, "\033[31mwindow should be 1 to 1024\r\n");
+	}
+	term_Print(ph->term, "%d requests in flight\r\n", ph->sftp_window);
+}
+//compare sha-256 of the local file, given as hex or still being computed
+//by fh, with sha256sum of the remote file
+void sftp_check(HOST *ph, const char *rpath, const char *name,
+								const char *hex, struct file_hash *fh)
+{
+	char cmd[4200], out[256];
+	int len = sprintf(cmd, "sha256sum <");
+	len += sh_quote(cmd+len, rpath);
+	strcpy(cmd+len, " 2>/dev/null");
+	if ( sftp_exec(ph, cmd, out, sizeof(out))<0 ) *out = 0;
+	if ( fh!=NULL ) hex = hash_Wait(fh);
+
+	term_Print(ph->term, "verify %s\t\t\t", name);
+	if ( *hex==0 ) 
+		term_Print(ph->term, "\033[31mno local hash");
+	else if ( strlen(out)<64 ) 
+		term_Print(ph->term, "\033[31mno remote hash");
+	else if ( strncmp(out, hex, 64)==0 )
+		term_Print(ph->term, "sha256 %.16s ok", hex);
+	else
+		term_Print(ph->term, "\033[31msha256 mismatch");
+	term_Print(ph->term, "\r\n");
+	free(fh);
+}
+//size of the partial copy, remote file for put or local file for get,
+//if the last 4KB of it matches the source, or 0 to start over
+libssh2_uint64_t sftp_resume(LIBSSH2_SFTP_HANDLE *sftp_handle, FILE *fp,
+															BOOL bGet)
+{
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	if ( libssh2_sftp_fstat(sftp_handle, &attrs)!=0 ) return 0;
+	if ( _fseeki64(fp, 0, SEEK_END)!=0 ) return 0;
+	libssh2_uint64_t lsize = _ftelli64(fp);
+	libssh2_uint64_t done = bGet ? lsize : attrs.filesize;
+	libssh2_uint64_t full = bGet ? attrs.filesize : lsize;
+	if ( done==0 || done>full ) return 0;
+
+	char lbuf[4096], rbuf[4096];
+	size_t n = done<sizeof(lbuf) ? (size_t)done : sizeof(lbuf);
+	_fseeki64(fp, done-n, SEEK_SET);
+	if ( fread(lbuf, 1, n, fp)!=n ) return 0;
+	libssh2_sftp_seek64(sftp_handle, done-n);
+	for ( size_t got=0; got<n; ) {
+		int rc = libssh2_sftp_read(sftp_handle, rbuf+got, n-got);
+		if ( rc<=0 ) return 0;
+		got += rc;
+	}
+	return memcmp(lbuf, rbuf, n)==0 ? done : 0;
+}
+void sftp_verify(HOST *ph, char *onoff)
+{
+	if ( strcmp(onoff, "on")==0 ) ph->bVerify = TRUE;
+	if ( strcmp(onoff, "off")==0 ) ph->bVerify = FALSE;
+	term_Print(ph->term, "sha-256 verify is %s\r\n", ph->bVerify?"on":"off");
+}
+void sftp_get_one(HOST *ph, char *src, char *dst, BOOL bResume)
 {
 	term_Print(ph->term, "get %s\t\t\t", dst);
 	LIBSSH2_SFTP_HANDLE *sftp_handle=libssh2_sftp_open(ph->sftp,
@@ -1140,93 +3542,208 @@ void sftp_get_one(HOST *ph, char *src, char *dst)
 		term_Print(ph->term, "\033[31mUnable to read remote file\r\n");
 		return;
 	}
-	FILE *fp = fopen_utf8(dst, "wb");
+	libssh2_uint64_t offset = 0;
+	FILE *fp = bResume ? fopen_utf8(dst, "r+b") : NULL;
+	if ( fp!=NULL ) {
+		offset = sftp_resume(sftp_handle, fp, TRUE);
+		if ( offset==0 ) {					//no usable partial copy
+			fclose(fp);
+			fp = NULL;
+		}
+		else {
+			LIBSSH2_SFTP_ATTRIBUTES attrs;
+			if ( libssh2_sftp_fstat(sftp_handle, &attrs)==0
+								&& attrs.filesize==offset ) {
+				term_Print(ph->term, "\033[12Dalready complete\r\n");
+				fclose(fp);
+				libssh2_sftp_close(sftp_handle);
+				return;
+			}
+			_fseeki64(fp, offset, SEEK_SET);
+			libssh2_sftp_seek64(sftp_handle, offset);
+			term_Print(ph->term, "\033[12D\033[33mresume at %lldKB\r\n"
+						"get %s\t\t\t", (long long)offset>>10, dst);
+		}
+	}
+	if ( fp==NULL ) fp = fopen_utf8(dst, "wb");
 	if ( fp==NULL ) {
 		term_Print(ph->term, "\033[31munable to create local file\r\n");
 		libssh2_sftp_close(sftp_handle);
 		return;
 	}
 
-	long total=0;
+	//libssh2 keeps read requests of up to SFTP_READ_SIZE in flight for
+	//4 times the buffer size, and hands the data back in order, so the
+	//buffer is sized to keep sftp_window requests outstanding
+	size_t size = ph->sftp_window*SFTP_READ_SIZE/4;
+	char *mem = (char *)malloc(size);
+	struct disk_writer w;				//not preallocated, reget may resume
+	if ( mem==NULL || !writer_Open(&w, fp, 0, ph->bVerify && offset==0) ) {
+		term_Print(ph->term, "\033[31mout of memory\r\n");
+		free(mem);
+		fclose(fp);
+		libssh2_sftp_close(sftp_handle);
+		return;
+	}
+	long long total=0;
 	time_t start = time(NULL);
-	char mem[1024*64];
-	int rc, blocks=0;
-	while ( (rc=libssh2_sftp_read(sftp_handle, mem, sizeof(mem)))>0 ) {
-		int nwrite = fwrite(mem, 1, rc, fp);
+	int rc;
+	DWORD last = 0;
+	while ( (rc=libssh2_sftp_read(sftp_handle, mem, size))>0 ) {
+		int nwrite = writer_Write(&w, mem, rc);
 		if ( nwrite>0 ) {
 			total += nwrite;
-			if ( ++blocks==32 ) {
-				blocks = 0;
-				term_Print(ph->term, "\033[12D% 10ldKB", total>>10);
-			}
+			if ( progress_Due(&last) )
+				term_Print(ph->term, "\033[12D% 10lldKB", total>>10);
 		}
 		if ( nwrite<rc ) {
 			term_Print(ph->term, "\033[31merror writing to file");
 			break;
 		}
 	}
-	if ( rc==0 ) print_total(ph->term, start, total);
+	if ( !writer_Close(&w) && rc<=0 ) {
+		term_Print(ph->term, "\033[31merror writing to file");
+		rc = 1;
+	}
+	if ( rc==0 ) {
+		print_total(ph->term, start, total);
+		print_disk(ph->term, GetTickCount()-w.start, w.wait_ms);
+	}
+	if ( rc<0 ) term_Print(ph->term, "\033[31merror reading from host");
 	term_Print(ph->term, "\r\n");
+	free(mem);
 	fclose(fp);
 	libssh2_sftp_close(sftp_handle);
+	if ( rc==0 && ph->bVerify ) 			//resumed file is hashed whole
+		sftp_check(ph, src, dst, w.hex, offset==0 ? NULL : hash_Start(dst));
 }
-void sftp_put_one(HOST *ph, char *src, char *dst)
+#define SFTP_WRITE_SIZE 30000		//largest write request libssh2 sends
+void sftp_put_one(HOST *ph, char *src, char *dst, BOOL bResume)
 {
+	rdir_Drop(ph, dst);
 	term_Print(ph->term, "put %s\t\t\t", dst);
+	unsigned long flags = LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT;
+	flags |= bResume ? LIBSSH2_FXF_READ : LIBSSH2_FXF_TRUNC;
 	LIBSSH2_SFTP_HANDLE *sftp_handle = libssh2_sftp_open(ph->sftp, dst,
-					  LIBSSH2_FXF_WRITE|LIBSSH2_FXF_CREAT|LIBSSH2_FXF_TRUNC,
-					  LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|
+					  flags, LIBSSH2_SFTP_S_IRUSR|LIBSSH2_SFTP_S_IWUSR|
 					  LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IROTH);
 	if (!sftp_handle) {
 		term_Print(ph->term, "\033[31mcouldn't create remote file\r\n");
 		return;
 	}
-	FILE *fp = fopen_utf8(src, "rb");
+	FILE *fp = fopen_utf8(src, "rbS");			//sequential read ahead
 	if ( fp==NULL ) {
 		term_Print(ph->term, "\033[31mcouldn't read local file\r\n");
+		libssh2_sftp_close(sftp_handle);
 		return;
 	}
+	if ( bResume ) {
+		libssh2_uint64_t offset = sftp_resume(sftp_handle, fp, FALSE);
+		if ( offset==0 ) {					//start over from an empty file
+			LIBSSH2_SFTP_ATTRIBUTES attrs;
+			memset(&attrs, 0, sizeof(attrs));
+			attrs.flags = LIBSSH2_SFTP_ATTR_SIZE;
+			libssh2_sftp_fsetstat(sftp_handle, &attrs);
+		}
+		else {
+			if ( _fseeki64(fp, 0, SEEK_END)==0 
+					&& (libssh2_uint64_t)_ftelli64(fp)==offset ) {
+				term_Print(ph->term, "\033[12Dalready complete\r\n");
+				fclose(fp);
+				libssh2_sftp_close(sftp_handle);
+				return;
+			}
+			term_Print(ph->term, "\033[12D\033[33mresume at %lldKB\r\n"
+						"put %s\t\t\t", (long long)offset>>10, dst);
+		}
+		_fseeki64(fp, offset, SEEK_SET);
+		libssh2_sftp_seek64(sftp_handle, offset);
+	}
 
-	char mem[1024*64];
-	int nread, blocks = 0;
-	long total=0;
+	//libssh2_sftp_write sends the whole buffer as write requests of up to
+	//SFTP_WRITE_SIZE, and returns once the first ones are acknowledged.
+	//it must then be given the unacknowledged tail again, which it won't
+	//resend, plus new data, so up to sftp_window requests stay in flight.
+	//the buffer is twice the window so the tail is only moved down after
+	//a full window has been acknowledged
+	size_t window = ph->sftp_window*SFTP_WRITE_SIZE;
+	char *mem = (char *)malloc(window*2);
+	if ( mem==NULL ) {
+		term_Print(ph->term, "\033[31mout of memory\r\n");
+		fclose(fp);
+		libssh2_sftp_close(sftp_handle);
+		return;
+	}
+	size_t off = 0, len = 0;		//mem+off holds len bytes not yet acked
+	BOOL bEof = FALSE;
+	int rc = 0;
+	DWORD last = 0;
+	long long total=0;
 	time_t start = time(NULL);
-	while ( (nread=fread(mem, 1, sizeof(mem), fp))>0 ) {
-		int rc=0;
-		for ( int nwrite=0; nwrite<nread && rc>=0; ){
-			rc=libssh2_sftp_write(sftp_handle, mem+nwrite, nread-nwrite);
-			if ( rc>0 ) {
-				nwrite += rc;
-				total += rc;
+	DWORD tick = GetTickCount(), disk_ms = 0;
+	struct file_hash *fh = ph->bVerify ? hash_Start(src) : NULL;
+	while ( TRUE ) {
+		if ( !bEof && len<window ) {
+			if ( off+len==window*2 || off>=window ) {
+				memmove(mem, mem+off, len);
+				off = 0;
 			}
+			DWORD t = GetTickCount();
+			size_t nread = fread(mem+off+len, 1, 
+								min(window-len, window*2-off-len), fp);
+			disk_ms += GetTickCount()-t;
+			if ( nread==0 ) {
+				bEof = TRUE;
+				if ( ferror(fp) ) {
+					term_Print(ph->term, "\033[31merror reading local file");
+					break;
+				}
+			}
+			len += nread;
 		}
+		if ( len==0 ) break;		//all data acknowledged
+
+		rc = libssh2_sftp_write(sftp_handle, mem+off, len);
 		if ( rc>0 ) {
-			if ( ++blocks==32 ) {
-				blocks = 0;
-				term_Print(ph->term, "\033[12D% 10ldKB", total>>10);
-			}
+			off += rc;
+			len -= rc;
+			total += rc;
+			if ( progress_Due(&last) )
+				term_Print(ph->term, "\033[12D% 10lldKB", total>>10);
 		}
-		else {
-			term_Print(ph->term, "\033[31merror writing to host");
+		else if ( rc!=LIBSSH2_ERROR_EAGAIN ) {
+			term_Print(ph->term, "\033[31merror %lu writing to host at %lld",
+						libssh2_sftp_last_error(ph->sftp), total);
 			break;
 		}
 	}
-	if ( nread==0 ) print_total(ph->term, start, total);
+	if ( bEof && len==0 ) {
+		print_total(ph->term, start, total);
+		print_disk(ph->term, GetTickCount()-tick, disk_ms);
+	}
 	term_Print(ph->term, "\r\n");
+	free(mem);
 	fclose(fp);
 	libssh2_sftp_close(sftp_handle);
+	if ( fh!=NULL ) {
+		if ( bEof && len==0 ) 
+			sftp_check(ph, dst, dst, "", fh);
+		else {
+			hash_Wait(fh);
+			free(fh);
+		}
+	}
 }
-void sftp_get(HOST *ph, char *src, char *dst)
+void sftp_get(HOST *ph, char *src, char *dst, BOOL bResume)
 {
 	char mem[512];
 	LIBSSH2_SFTP_ATTRIBUTES attrs;
 	LIBSSH2_SFTP_HANDLE *sftp_handle;
 
-	if ( WaitForSingleObject(ph->mtx, INFINITE)!=WAIT_OBJECT_0 ) return;
 	if ( strchr(src,'*')==NULL && strchr(src, '?')==NULL ) {
 		char lfile[1024];
 		strcpy(lfile, *dst?dst:".");
-		struct _stat statbuf;
+		struct _stat64 statbuf;
 		if ( stat_utf8(lfile, &statbuf)!=-1 ) {
 			if ( (statbuf.st_mode & S_IFMT) == S_IFDIR ) {
 				strcat(lfile, "/");
@@ -1235,7 +3752,7 @@ void sftp_get(HOST *ph, char *src, char *dst)
 				strcat(lfile, p);
 			}
 		}
-		sftp_get_one( ph, src, lfile);
+		sftp_get_one( ph, src, lfile, bResume);
 	}
 	else {
 		char *pattern = strrchr(src, '/');
@@ -1251,7 +3768,7 @@ void sftp_get(HOST *ph, char *src, char *dst)
 				if ( fnmatch(pattern, mem, 0)==0 ) {
 					strcpy(rfile+rlen, mem);
 					strcpy(lfile+llen, mem);
-					sftp_get_one( ph, rfile, lfile);
+					sftp_get_one( ph, rfile, lfile, bResume);
 				}
 			}
 			libssh2_sftp_closedir(sftp_handle);
@@ -1260,15 +3777,13 @@ void sftp_get(HOST *ph, char *src, char *dst)
 			term_Print(ph->term, "\033[31mcould't open remote dir %s\r\n", src);
 		}
 	}
-	ReleaseMutex(ph->mtx);
 }
-void sftp_put(HOST *ph, char *src, char *dst)
+void sftp_put(HOST *ph, char *src, char *dst, BOOL bResume)
 {
 	DIR *dir;
 	struct dirent *dp;
-	struct _stat statbuf;
+	struct _stat64 statbuf;
 
-	if ( WaitForSingleObject(ph->mtx, INFINITE)!=WAIT_OBJECT_0 ) return;
 	if ( stat_utf8(src, &statbuf)!=-1 ) {
 		char rfile[1024];
 		strcpy(rfile, *dst?dst:".");
@@ -1281,7 +3796,7 @@ void sftp_put(HOST *ph, char *src, char *dst)
 				strcat(rfile, p);
 			}
 		}
-		sftp_put_one( ph, src, rfile);
+		sftp_put_one( ph, src, rfile, bResume);
 	}
 	else {
 		char *pattern=src;
@@ -1303,14 +3818,216 @@ void sftp_put(HOST *ph, char *src, char *dst)
 				if ( fnmatch(pattern, dp->d_name, 0)==0 ) {
 					strcpy(lfile+llen, dp->d_name);
 					strcpy(rfile+rlen, dp->d_name);
-					sftp_put_one( ph, lfile, rfile);
+					sftp_put_one( ph, lfile, rfile, bResume);
 				}
 			}
 		}
 		else
 			term_Print(ph->term, "\033[31mcouldn't open \033[32m%s\r\n",lfile);
 	}
-	ReleaseMutex(ph->mtx);
+}
+struct sync_entry {					//remote directory entry for sync
+	char name[256];
+	libssh2_uint64_t size;
+	unsigned long mtime;
+	BOOL bDir;
+};
+struct sync_stats {
+	int files, dirs, copied, failed;
+};
+int sync_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct sync_entry *)a)->name,
+				  ((struct sync_entry *)b)->name);
+}
+//read a remote directory in one pass, readdir returns the attributes
+//of each entry with its name so no stat is sent per file
+struct sync_entry *sync_list(HOST *ph, const char *rdir, int *pcnt)
+{
+	*pcnt = 0;
+	LIBSSH2_SFTP_HANDLE *sftp_handle = libssh2_sftp_opendir(ph->sftp, rdir);
+	if ( sftp_handle==NULL ) return NULL;
+
+	int cnt = 0, size = 64;
+	struct sync_entry *list = (struct sync_entry *)
+							malloc(size*sizeof(struct sync_entry));
+	char name[256];
+	LIBSSH2_SFTP_ATTRIBUTES attrs;
+	while ( list!=NULL && libssh2_sftp_readdir(sftp_handle, name,
+										sizeof(name), &attrs)>0 ) {
+		if ( strcmp(name, ".")==0 || strcmp(name, "..")==0 ) continue;
+		BOOL bDir = LIBSSH2_SFTP_S_ISDIR(attrs.permissions);
+		if ( !bDir && !LIBSSH2_SFTP_S_ISREG(attrs.permissions) ) continue;
+		if ( cnt==size ) {
+			struct sync_entry *p = (struct sync_entry *)
+						realloc(list, size*2*sizeof(struct sync_entry));
+			if ( p==NULL ) break;
+			list = p;
+			size *= 2;
+		}
+		strcpy(list[cnt].name, name);
+		list[cnt].size = attrs.filesize;
+		list[cnt].mtime = attrs.mtime;
+		list[cnt].bDir = bDir;
+		cnt++;
+	}
+	libssh2_sftp_closedir(sftp_handle);
+	if ( list!=NULL ) qsort(list, cnt, sizeof(struct sync_entry), sync_cmp);
+	*pcnt = cnt;
+	return list;
+}
+//a copy is current if sizes match and it's no older than the source,
+//a source changed in the last 2 seconds may still be rewritten within
+//its mtime's second, so it is copied again
+BOOL sync_Current(libssh2_uint64_t dsize, time_t dmtime,
+									libssh2_uint64_t ssize, time_t smtime)
+{
+	return dsize==ssize && dmtime>=smtime && time(NULL)-smtime>=2;
+}
+//copy remote files that are missing locally, differ in size or are newer
+void sync_get(HOST *ph, const char *rdir, const char *ldir,
+										struct sync_stats *stats)
+{
+	WCHAR wdir[MAX_PATH];
+	struct _stat64 statbuf;
+	if ( stat_utf8(ldir, &statbuf)==-1 ) {
+		utf8_to_wchar(ldir, strlen(ldir)+1, wdir, MAX_PATH);
+		if ( _wmkdir(wdir)!=0 ) {
+			term_Print(ph->term, "\033[31mcouldn't create %s\r\n", ldir);
+			stats->failed++;
+			return;
+		}
+	}
+	int cnt;
+	struct sync_entry *list = sync_list(ph, rdir, &cnt);
+	if ( list==NULL ) {
+		term_Print(ph->term, "\033[31mcouldn't open remote dir %s\r\n", rdir);
+		stats->failed++;
+		return;
+	}
+	stats->dirs++;
+	char rfile[1024], lfile[1024];
+	for ( int i=0; i<cnt; i++ ) {
+		struct sync_entry *e = list+i;
+		if ( strlen(rdir)+strlen(e->name)>1020 
+		  || strlen(ldir)+strlen(e->name)>1020 ) continue;
+		sprintf(rfile, "%s/%s", rdir, e->name);
+		sprintf(lfile, "%s/%s", ldir, e->name);
+		if ( e->bDir ) {
+			sync_get(ph, rfile, lfile, stats);
+			continue;
+		}
+		stats->files++;
+		if ( stat_utf8(lfile, &statbuf)!=-1
+			&& sync_Current(statbuf.st_size, statbuf.st_mtime,
+									e->size, (time_t)e->mtime) ) continue;
+
+		sftp_get_one(ph, rfile, lfile, FALSE);
+		if ( stat_utf8(lfile, &statbuf)==-1 
+			|| (libssh2_uint64_t)statbuf.st_size!=e->size ) {
+			stats->failed++;
+			continue;
+		}
+		struct _utimbuf times;					//so next sync skips it
+		times.actime = times.modtime = e->mtime;
+		utf8_to_wchar(lfile, strlen(lfile)+1, wdir, MAX_PATH);
+		_wutime(wdir, &times);
+		stats->copied++;
+	}
+	free(list);
+}
+//copy local files that are missing remotely, differ in size or are newer
+void sync_put(HOST *ph, const char *ldir, const char *rdir,
+										struct sync_stats *stats)
+{
+	DIR *dir = opendir(ldir);
+	if ( dir==NULL ) {
+		term_Print(ph->term, "\033[31mcouldn't open %s\r\n", ldir);
+		stats->failed++;
+		return;
+	}
+	int cnt;
+	struct sync_entry *list = sync_list(ph, rdir, &cnt);
+	if ( list==NULL ) {
+		if ( libssh2_sftp_mkdir(ph->sftp, rdir, LIBSSH2_SFTP_S_IRWXU|
+								LIBSSH2_SFTP_S_IRGRP|LIBSSH2_SFTP_S_IXGRP|
+								LIBSSH2_SFTP_S_IROTH|LIBSSH2_SFTP_S_IXOTH) ) {
+			term_Print(ph->term, "\033[31mcouldn't create %s\r\n", rdir);
+			stats->failed++;
+			closedir(dir);
+			return;
+		}
+	}
+	stats->dirs++;
+	struct dirent *dp;
+	char rfile[1024], lfile[1024];
+	while ( (dp=readdir(dir))!=NULL ) {
+		if ( strcmp(dp->d_name, ".")==0 || strcmp(dp->d_name, "..")==0 ) 
+			continue;
+		if ( strlen(rdir)+strlen(dp->d_name)>1020 
+		  || strlen(ldir)+strlen(dp->d_name)>1020 ) continue;
+		sprintf(lfile, "%s/%s", ldir, dp->d_name);
+		sprintf(rfile, "%s/%s", rdir, dp->d_name);
+		if ( dp->d_type==DT_DIR ) {
+			sync_put(ph, lfile, rfile, stats);
+			continue;
+		}
+		stats->files++;
+		struct _stat64 statbuf;
+		if ( stat_utf8(lfile, &statbuf)==-1 ) continue;
+		struct sync_entry key, *e = NULL;
+		strncpy(key.name, dp->d_name, 255);
+		key.name[255] = 0;
+		if ( list!=NULL ) 
+			e = (struct sync_entry *)bsearch(&key, list, cnt,
+								sizeof(struct sync_entry), sync_cmp);
+		if ( e!=NULL && !e->bDir
+			&& sync_Current(e->size, (time_t)e->mtime,
+							statbuf.st_size, statbuf.st_mtime) ) continue;
+
+		sftp_put_one(ph, lfile, rfile, FALSE);
+		LIBSSH2_SFTP_ATTRIBUTES attrs;
+		if ( libssh2_sftp_stat(ph->sftp, rfile, &attrs)!=0
+			|| attrs.filesize!=(libssh2_uint64_t)statbuf.st_size ) {
+			stats->failed++;
+			continue;
+		}
+		attrs.flags = LIBSSH2_SFTP_ATTR_ACMODTIME;	//so next sync skips it
+		attrs.atime = attrs.mtime = (unsigned long)statbuf.st_mtime;
+		libssh2_sftp_setstat(ph->sftp, rfile, &attrs);
+		stats->copied++;
+	}
+	closedir(dir);
+	free(list);
+}
+void sftp_sync(HOST *ph, char *src, char *dst, BOOL bPut)
+{
+	struct sync_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	for ( int i=strlen(src)-1; i>0 && src[i]=='/'; i-- ) src[i] = 0;
+	for ( int i=strlen(dst)-1; i>0 && dst[i]=='/'; i-- ) dst[i] = 0;
+	if ( *src==0 || *dst==0 ) {
+		term_Print(ph->term, "\033[31mboth source and destination needed\r\n");
+		return;
+	}
+	if ( bPut ) {
+		sync_put(ph, src, dst, &stats);
+		rdir_Drop(ph, NULL);
+	}
+	else
+		sync_get(ph, src, dst, &stats);
+	term_Print(ph->term, "\033[32m%d dirs, %d files checked, %d copied",
+						stats.dirs, stats.files, stats.copied);
+	if ( stats.failed>0 )
+		term_Print(ph->term, ", \033[31m%d failed", stats.failed);
+	term_Print(ph->term, "\r\n");
+}
+BOOL sftp_Lock(HOST *ph)		//prefetch gives up mtx_sftp while we wait
+{
+	InterlockedIncrement(&ph->sftp_waiting);
+	BOOL bLocked = WaitForSingleObject(ph->mtx_sftp, INFINITE)==WAIT_OBJECT_0;
+	InterlockedDecrement(&ph->sftp_waiting);
+	return bLocked;
 }
 int sftp_cmd(HOST *ph, char *cmd)
 {
@@ -1334,6 +4051,15 @@ int sftp_cmd(HOST *ph, char *cmd)
 	}
 	if ( p2==NULL ) p2 = p1+strlen(p1);
 
+	int ls_opts = 0;			//ls -u unsorted, -p paged, before the path
+	if ( (strncmp(cmd, "ls", 2)==0 || strncmp(cmd, "dir", 3)==0) 
+			&& *p1=='-' ) {
+		if ( strchr(p1, 'u')!=NULL ) ls_opts |= LS_UNSORTED;
+		if ( strchr(p1, 'p')!=NULL ) ls_opts |= LS_PAGED;
+		p1 = p2;
+		p2 = p1+strlen(p1);
+	}
+
 	strcpy(src, p1);			//src is remote source file
 	if ( *p1!='/') {
 		strcpy(src, ph->realpath);
@@ -1355,15 +4081,22 @@ int sftp_cmd(HOST *ph, char *cmd)
 	else if ( strncmp(cmd, "lcd",3)==0 ) sftp_lcd(ph, p1);
 	else if ( strncmp(cmd, "pwd",3)==0 ) sftp_cd(ph, NULL);
 	else if ( strncmp(cmd, "cd", 2)==0 ) sftp_cd(ph, *p1==0?ph->homepath:src);
-	else if ( strncmp(cmd, "ls", 2)==0 ) sftp_ls(ph, src, FALSE);
-	else if ( strncmp(cmd, "dir",3)==0 ) sftp_ls(ph, src, TRUE);
+	else if ( strncmp(cmd, "ls", 2)==0 ) sftp_ls(ph, src, ls_opts);
+	else if ( strncmp(cmd, "dir",3)==0 ) sftp_ls(ph, src, ls_opts|LS_LONG);
 	else if ( strncmp(cmd, "mkdir",5)==0 ) sftp_md(ph, src);
 	else if ( strncmp(cmd, "rmdir",5)==0 ) sftp_rd(ph, src);
 	else if ( strncmp(cmd, "rm", 2)==0
 			||strncmp(cmd, "del",3)==0)  sftp_rm(ph, src);
 	else if ( strncmp(cmd, "ren",3)==0)  sftp_ren(ph, src, dst);
-	else if ( strncmp(cmd, "get",3)==0 ) sftp_get(ph, src, p2);
-	else if ( strncmp(cmd, "put",3)==0 ) sftp_put(ph, p1, dst);
+	else if ( strncmp(cmd, "cp", 2)==0 ) sftp_cp(ph, src, dst);
+	else if ( strncmp(cmd, "get",3)==0 ) sftp_get(ph, src, p2, FALSE);
+	else if ( strncmp(cmd, "put",3)==0 ) sftp_put(ph, p1, dst, FALSE);
+	else if ( strncmp(cmd, "reget",5)==0 ) sftp_get(ph, src, p2, TRUE);
+	else if ( strncmp(cmd, "reput",5)==0 ) sftp_put(ph, p1, dst, TRUE);
+	else if ( strncmp(cmd, "syncput",7)==0 ) sftp_sync(ph, p1, dst, TRUE);
+	else if ( strncmp(cmd, "sync",4)==0 ) sftp_sync(ph, src, p2, FALSE);
+	else if ( strncmp(cmd, "window",6)==0 ) sftp_window(ph, p1);
+	else if ( strncmp(cmd, "verify",6)==0 ) sftp_verify(ph, p1);
 	else if ( strncmp(cmd, "bye",3)==0 ) {
 		term_Disp(ph->term, "Logout!");
 		return -1;
@@ -1371,7 +4104,8 @@ int sftp_cmd(HOST *ph, char *cmd)
 	else if ( *cmd )
 		term_Print(ph->term, "\033[31m%s is not valid command, try %s\r\n\t%s\r\n",
 					cmd, "\033[37mlcd, lpwd, cd, pwd,",
-					"ls, dir, get, put, ren, rm, del, mkdir, rmdir, bye");
+					"ls, dir, get, put, reget, reput, sync, syncput, ren, cp, rm,"
+					" del, mkdir, rmdir, window, verify, bye");
 	return 0;
 }
 DWORD WINAPI sftp(void *pv)
@@ -1385,9 +4119,10 @@ DWORD WINAPI sftp(void *pv)
 
 	ph->status=CONNECTING;
 	term_Title(ph->term, ph->hostname);
-	if ( host_tcp(ph)==-1 ) goto TCP_Close;
+	if ( (ph->jumphost!=NULL ? ssh_jump(ph) : host_tcp(ph))==-1 ) 
+		goto TCP_Close;
 
-	ph->session = libssh2_session_init();
+	ph->session = libssh2_session_init_ex(NULL, NULL, NULL, ph);
 	int rc;
 	do {
 		rc = libssh2_session_handshake(ph->session, ph->sock);
@@ -1423,16 +4158,24 @@ DWORD WINAPI sftp(void *pv)
 	ph->type = SFTP;
 	ph->status = CONNECTED;
 	ph->sftp_running = TRUE;
+	rdir_Prefetch(ph, ph->realpath, TRUE);
 	while ( ph->sftp_running ) {
-		char *cmd = ssh2_Gets(ph, "\033[32msftp> \033[37m", TRUE);
+		char *cmd = ssh2_Gets(ph, SFTP_PROMPT, TRUE);
 		for ( int i=0; i<10 && cmd==NULL && ph->sftp_running; i++ )
 			cmd = ssh2_Gets(ph, "", TRUE);
 		if ( cmd==NULL ) {
 			term_Disp(ph->term, "Time Out!");
 			break;
 		}
-		if ( sftp_cmd( ph, cmd)==-1 ) break;
+		rc = 0;
+		if ( sftp_Lock(ph) ) {
+			rc = sftp_cmd( ph, cmd);
+			ReleaseMutex(ph->mtx_sftp);
+		}
+		if ( rc==-1 ) break;
 	}
+	ph->sftp_running = FALSE;
+	rdir_Close(ph);						//after prefetch threads are done
 	libssh2_sftp_shutdown(ph->sftp);
 	term_Error(ph->term, "Disconnected");
 	ph->type = NONE;
@@ -21,12 +21,13 @@
 #define isUTF8c(x) (((x)&0xc0)==0x80)
 
 const unsigned char *vt100_Escape(TERM *pt, const unsigned char *sz, int cnt);
+DWORD WINAPI term_Parser(void *pv);
 const unsigned char *telnet_Options(TERM *pt, const unsigned char *p, int cnt);
 void term_Clear(TERM *pt)
 {
-	memset(pt->buff, 0, BUFFERSIZE);
-	memset(pt->attr, 0, BUFFERSIZE);
-	memset(pt->line, 0, MAXLINES*sizeof(int));
+	memset(pt->buff, 0, pt->buff_size);
+	memset(pt->attr, 0, pt->buff_size);
+	memset(pt->line, 0, pt->max_lines*sizeof(int));
 	pt->c_attr = 7;
 	pt->cursor_y = pt->cursor_x = 0;
 	pt->screen_y = 0;
@@ -40,6 +41,7 @@ void term_Clear(TERM *pt)
 	pt->bEscape = FALSE;
 	pt->bInsert = FALSE;
 	pt->bTitle = FALSE;
+	pt->bST = FALSE;
 	pt->bOriginMode = FALSE;
 	pt->bWraparound = TRUE;
 	pt->bCursor = TRUE;
@@ -50,35 +52,66 @@ void term_Clear(TERM *pt)
 	memset(pt->tabstops, 0, 256);
 	for ( int i=0; i<256; i+=8 ) pt->tabstops[i]=1;
 }
-BOOL term_Construct(TERM *pt)
+BOOL term_Construct(TERM *pt, int lines)
 {
+	pt->id = -1;
+	pt->bHeadless = FALSE;
+	pt->max_lines = lines;
+	pt->buff_size = lines*(BUFFERSIZE/MAXLINES);
 	pt->size_x=80;
 	pt->size_y=25;
 	pt->bLogging=FALSE;
 	pt->bEcho=FALSE;
 	pt->title_idx=0;
+	pt->osc_code=0;
+	*pt->cwd=0;
+	pt->bCwd=FALSE;
 	strcpy(pt->sPrompt, "> ");
 	pt->iPrompt=2;
 	pt->iTimeOut=30;
 	pt->tl1len=0;
 	pt->tl1text=NULL;
-	pt->mtx = CreateMutex(NULL, FALSE, L"term parse mutex");
+	pt->mtx = CreateMutex(NULL, FALSE, NULL);	//one per session, unnamed
+	pt->mtx_cmd = CreateMutex(NULL, FALSE, NULL);
 
-	pt->buff = (char *)malloc(BUFFERSIZE);
-	pt->attr = (char *)malloc(BUFFERSIZE);
-	pt->line = (int * )malloc(MAXLINES*sizeof(int));
+	pt->buff = (char *)malloc(pt->buff_size);
+	pt->attr = (char *)malloc(pt->buff_size);
+	pt->line = (int * )malloc(pt->max_lines*sizeof(int));
+	pt->ring = (char *)malloc(RINGSIZE);
+	pt->ring_head = pt->ring_tail = 0;
+	pt->ring_max = pt->ring_stalls = 0;
+	pt->ring_bytes = 0;
+	pt->bStalled = FALSE;
+	pt->hRingData = CreateEvent(NULL, FALSE, FALSE, NULL);
+	pt->hRingSpace = CreateEvent(NULL, FALSE, FALSE, NULL);
 
-	if ( pt->buff!=NULL && pt->attr!=NULL && pt->line!=NULL ) {
+	if ( pt->buff!=NULL && pt->attr!=NULL && pt->line!=NULL 
+						&& pt->ring!=NULL ) {
 		term_Clear(pt);
-		return TRUE;
+		pt->bParser = TRUE;
+		pt->hParser = CreateThread(NULL, 0, term_Parser, pt, 0, 
+												&pt->parser_tid);
+		if ( pt->hParser!=NULL ) return TRUE;
+		pt->bParser = FALSE;
 	}
 	return FALSE;
 }
 void term_Destruct(TERM *pt)
 {
+	if ( pt->bParser ) {
+		pt->bParser = FALSE;
+		SetEvent(pt->hRingData);
+		WaitForSingleObject(pt->hParser, INFINITE);
+		CloseHandle(pt->hParser);
+	}
 	free(pt->buff);
 	free(pt->attr);
 	free(pt->line);
+	free(pt->ring);
+	CloseHandle(pt->hRingData);
+	CloseHandle(pt->hRingSpace);
+	CloseHandle(pt->mtx);
+	CloseHandle(pt->mtx_cmd);
 }
 void term_Size(TERM *pt, int x, int y)
 {
@@ -90,7 +123,7 @@ void term_Size(TERM *pt, int x, int y)
 		pt->screen_y = max(0, pt->cursor_y-pt->size_y+1);
 	}
 	host_Send_Size(pt->host, pt->size_x, pt->size_y);
-	tiny_Redraw();
+	if ( !pt->bHeadless ) tiny_Redraw();
 }
 void term_nextLine(TERM *pt)
 {
@@ -99,52 +132,125 @@ void term_nextLine(TERM *pt)
 		pt->line[pt->cursor_y+1]=pt->cursor_x;
 	if (pt->screen_y==pt->cursor_y-pt->size_y ) pt->screen_y++;
 
-	if (pt->cursor_x>=BUFFERSIZE-1024 || pt->cursor_y>=MAXLINES-4 ) {
-		int i, len = pt->line[4096];
+	if (pt->cursor_x>=pt->buff_size-1024 || pt->cursor_y>=pt->max_lines-4 ) {
+		int i, drop = pt->max_lines/4;	//drop oldest quarter of scroll back
+		if ( drop>pt->cursor_y/2 ) drop = pt->cursor_y/2;
+		int len = pt->line[drop];
 		pt->tl1text -= len;
 		if (pt->tl1text<pt->buff ) {
 			pt->tl1len -= pt->buff-pt->tl1text;
 			pt->tl1text = pt->buff;
 		}
 		pt->cursor_x -= len;
-		pt->cursor_y -= 4096;
-		pt->screen_y -= 4096;
+		pt->cursor_y -= drop;
+		pt->screen_y -= drop;
 		if (pt->screen_y<0 ) pt->screen_y = 0;
-		memmove(pt->buff, pt->buff+len, BUFFERSIZE-len);
-		memset(pt->buff+pt->cursor_x, 0, BUFFERSIZE-pt->cursor_x);
-		memmove(pt->attr, pt->attr+len, BUFFERSIZE-len);
-		memset(pt->attr+pt->cursor_x, 0, BUFFERSIZE-pt->cursor_x);
+		memmove(pt->buff, pt->buff+len, pt->buff_size-len);
+		memset(pt->buff+pt->cursor_x, 0, pt->buff_size-pt->cursor_x);
+		memmove(pt->attr, pt->attr+len, pt->buff_size-len);
+		memset(pt->attr+pt->cursor_x, 0, pt->buff_size-pt->cursor_x);
 		for ( i=0; i<pt->cursor_y+2; i++ ) 
-			pt->line[i] = pt->line[i+4096]-len;
-		while ( i<MAXLINES ) pt->line[i++] = 0;
+			pt->line[i] = pt->line[i+drop]-len;
+		while ( i<pt->max_lines ) pt->line[i++] = 0;
 	}
 }
-void term_Parse(TERM *pt, const char *buf, int len)
+/**************************reader to parser ring*************************
+ * readers only copy into the ring, a parser thread per term empties it,
+ * so a slow parse or redraw never holds up reading from the host. when
+ * the ring is full readers stop reading, and tcp/ssh flow control slows
+ * the host down instead of the window freezing
+ */
+int term_Room(TERM *pt)		//0 marks the reader stalled until parser resumes it
 {
-	const unsigned char *p=(const unsigned char *)buf;
-	const unsigned char *zz = p+len;
-
-	if ( WaitForSingleObject(pt->mtx, INFINITE)!=WAIT_OBJECT_0 ) return;
-	if (pt->bLogging ) fwrite( buf, 1, len, pt->fpLogFile);
-	if (pt->bEscape ) p = vt100_Escape(pt, p, zz-p);
-	while ( p < zz ) {
-		unsigned char c = *p++;
-		if (pt->bTitle ) {
-			if ( c==0x07 ) {
-				pt->bTitle = FALSE;
-				pt->title[pt->title_idx]=0;
-				tiny_Title(pt->title);
+	int room = RINGSIZE-(pt->ring_head-pt->ring_tail);
+	if ( room==0 ) {
+		pt->bStalled = TRUE;
+		InterlockedIncrement(&pt->ring_stalls);
+		MemoryBarrier();
+		room = RINGSIZE-(pt->ring_head-pt->ring_tail);
+	}
+	return room;
+}
+int term_Feed(TERM *pt, const char *buf, int len, BOOL bWait)
+{
+	int total = 0;
+	while ( total<len ) {
+		LONG head = pt->ring_head;
+		int room = term_Room(pt);
+		if ( room==0 ) {
+			if ( !bWait || !pt->bParser ) break;
+			WaitForSingleObject(pt->hRingSpace, 100);
+			continue;
+		}
+		int n = min(len-total, room);
+		int off = head&(RINGSIZE-1);
+		int n1 = min(n, RINGSIZE-off);
+		memcpy(pt->ring+off, buf+total, n1);
+		memcpy(pt->ring, buf+total+n1, n-n1);
+		MemoryBarrier();				//data before head
+		pt->ring_head = head+n;
+		total += n;
+		SetEvent(pt->hRingData);
+	}
+	LONG used = pt->ring_head-pt->ring_tail;
+	if ( used>pt->ring_max ) pt->ring_max = used;
+	pt->ring_bytes += total;
+	return total;
+}
+void term_Drain(TERM *pt)	//let parser catch up so messages come in order
+{
+	if ( !pt->bParser || GetCurrentThreadId()==pt->parser_tid ) return;
+	LONG head = pt->ring_head;
+	for ( int i=0; i<1000 && (LONG)(head-pt->ring_tail)>0; i++ ) Sleep(1);
+}
+DWORD WINAPI term_Parser(void *pv)
+{
+	TERM *pt = (TERM *)pv;
+	char xml[4097];
+	while ( pt->bParser ) {
+		WaitForSingleObject(pt->hRingData, INFINITE);
+		LONG tail = pt->ring_tail;
+		while ( tail!=pt->ring_head ) {
+			MemoryBarrier();			//head before data
+			int off = tail&(RINGSIZE-1);
+			int n = min(pt->ring_head-tail, RINGSIZE-off);
+			if ( host_Type(pt->host)==NETCONF ) {
+				n = min(n, 4096);		//term_Parse_XML wants a string
+				memcpy(xml, pt->ring+off, n);
+				xml[n] = 0;
+				term_Parse_XML(pt, xml, n);
 			}
 			else
-				if (pt->title_idx<63 ) 
-					pt->title[pt->title_idx++] = c;
-			continue;
+				term_Parse(pt, pt->ring+off, n);
+			tail += n;
+			pt->ring_tail = tail;
+			SetEvent(pt->hRingSpace);
+			if ( pt->bStalled ) {
+				pt->bStalled = FALSE;
+				host_Resume(pt->host);
+			}
 		}
+	}
+	return 0;
+}
+/*************************parse loop variants****************************
+ * the modes below only change in escape sequences, so rather than test
+ * them on every byte, one copy of the loop is compiled for each mode
+ * combination, picked once per run of text between escape sequences
+ */
+static __forceinline const unsigned char *parse_run(TERM *pt,
+					const unsigned char *p, const unsigned char *zz,
+					const BOOL bGraphic, const BOOL bInsert,
+					const BOOL bAlterScreen, const BOOL bWraparound)
+{
+	while ( p < zz ) {
+		unsigned char c = *p++;
 		switch ( c ) {
 		case 0x00:
 		case 0x0e:
 		case 0x0f: 	break;
-		case 0x07:	tiny_Beep();break;
+		case 0x07:	if ( !pt->bHeadless ) tiny_Beep();
+					break;
 		case 0x08:
 			if (pt->cursor_x>pt->line[pt->cursor_y] ) {
 				if ( isUTF8c(pt->buff[pt->cursor_x--]) )//utf8 continuation
@@ -164,7 +270,8 @@ void term_Parse(TERM *pt, const char *buf, int len)
 		case 0x0a:
 		case 0x0b:
 		case 0x0c:
-			if (pt->bAlterScreen || pt->line[pt->cursor_y+2]!=0 ) {
+			pt->bCwd = FALSE;		//a prompt without OSC 7 is not its dir
+			if (bAlterScreen || pt->line[pt->cursor_y+2]!=0 ) {
 					//IND to next line
 				vt100_Escape(pt, (const unsigned char *)"D", 1);
 			}
@@ -181,10 +288,10 @@ void term_Parse(TERM *pt, const char *buf, int len)
 			else
 				pt->cursor_x = pt->line[pt->cursor_y];
 			break;
-		case 0x1b:	p = vt100_Escape(pt, p, zz-p); break;
-		case 0xff:	p = telnet_Options(pt, p-1, zz-p+1); break;
+		case 0x1b:	return vt100_Escape(pt, p, zz-p);	//modes may change
+		case 0xff:	return telnet_Options(pt, p-1, zz-p+1);
 		case 0xe2:	
-			if (pt->bAlterScreen ) {
+			if (bAlterScreen ) {
 				c = ' ';			//hack utf8 box drawing
 				if ( *p++==0x94 )	//to make alterscreen easier
 				{	
@@ -203,7 +310,7 @@ void term_Parse(TERM *pt, const char *buf, int len)
 				p++;
 			}//fall through
 		default:
-			if (pt->bGraphic ) 
+			if (bGraphic ) 
 				switch ( c ) {
 				case 'q': c='_'; break;
 				case 'x':
@@ -215,14 +322,14 @@ void term_Parse(TERM *pt, const char *buf, int len)
 				case 'k':
 				default: c = ' ';
 			}
-			if (pt->bInsert ) 
+			if (bInsert ) 
 				vt100_Escape(pt, (const unsigned char *)"[1@", 3);
 			if (pt->cursor_x-pt->line[pt->cursor_y]>=pt->size_x ) {
 				int char_cnt=0;
 				for ( int i=pt->line[pt->cursor_y]; i<pt->cursor_x; i++ )
 					if ( !isUTF8c(pt->buff[i]) ) char_cnt++;
 				if ( char_cnt==pt->size_x ) {
-					if (pt->bWraparound )//pt->bAlterScreen
+					if (bWraparound )//bAlterScreen
 						term_nextLine(pt);
 					else
 						pt->cursor_x--; //don't overflow in vi
@@ -234,13 +341,84 @@ void term_Parse(TERM *pt, const char *buf, int len)
 				pt->line[pt->cursor_y+1]=pt->cursor_x;
 		}
 	}
+	return p;
+}
+#define PARSE_RUN(g, i, a, w) \
+static const unsigned char *parse_run_##g##i##a##w(TERM *pt, \
+					const unsigned char *p, const unsigned char *zz) \
+{ \
+	return parse_run(pt, p, zz, g, i, a, w); \
+}
+PARSE_RUN(0,0,0,0) PARSE_RUN(0,0,0,1) PARSE_RUN(0,0,1,0) PARSE_RUN(0,0,1,1)
+PARSE_RUN(0,1,0,0) PARSE_RUN(0,1,0,1) PARSE_RUN(0,1,1,0) PARSE_RUN(0,1,1,1)
+PARSE_RUN(1,0,0,0) PARSE_RUN(1,0,0,1) PARSE_RUN(1,0,1,0) PARSE_RUN(1,0,1,1)
+PARSE_RUN(1,1,0,0) PARSE_RUN(1,1,0,1) PARSE_RUN(1,1,1,0) PARSE_RUN(1,1,1,1)
+static const unsigned char *(*parse_runs[16])(TERM *pt,
+					const unsigned char *p, const unsigned char *zz) = {
+	parse_run_0000, parse_run_0001, parse_run_0010, parse_run_0011,
+	parse_run_0100, parse_run_0101, parse_run_0110, parse_run_0111,
+	parse_run_1000, parse_run_1001, parse_run_1010, parse_run_1011,
+	parse_run_1100, parse_run_1101, parse_run_1110, parse_run_1111
+};
+void term_Cwd(TERM *pt)					//OSC 7 from the shell prompt
+{
+	pt->osc[pt->title_idx] = 0;
+	char *p = strstr(pt->osc, "://");
+	p = p==NULL ? pt->osc : strchr(p+3, '/');
+	if ( p!=NULL && *p=='/' ) {
+		url_decode(p);
+		strcpy(pt->cwd, p);
+		pt->bCwd = TRUE;
+	}
+}
+void term_Parse(TERM *pt, const char *buf, int len)
+{
+	const unsigned char *p=(const unsigned char *)buf;
+	const unsigned char *zz = p+len;
+
+	if ( WaitForSingleObject(pt->mtx, INFINITE)!=WAIT_OBJECT_0 ) return;
+	if (pt->bLogging ) fwrite( buf, 1, len, pt->fpLogFile);
+	if (pt->bST ) {						//ST split across reads
+		pt->bST = FALSE;
+		if ( p<zz && *p=='\\' ) p++;
+	}
+	if (pt->bEscape ) p = vt100_Escape(pt, p, zz-p);
+	while ( p < zz ) {
+		if (pt->bTitle ) {
+			unsigned char c = *p++;
+			if ( c==0x07 || c==0x1b ) {		//BEL or ST ends it
+				if ( c==0x1b ) {
+					if ( p==zz ) pt->bST = TRUE;
+					else if ( *p=='\\' ) p++;
+				}
+				pt->bTitle = FALSE;
+				if ( pt->osc_code==7 ) 
+					term_Cwd(pt);
+				else {
+					pt->title[pt->title_idx]=0;
+					if ( !pt->bHeadless ) tiny_Title(pt->title);
+				}
+			}
+			else if ( pt->osc_code==7 ) {
+				if ( pt->title_idx<MAX_PATH-1 ) 
+					pt->osc[pt->title_idx++] = c;
+			}
+			else
+				if (pt->title_idx<63 ) 
+					pt->title[pt->title_idx++] = c;
+			continue;
+		}
+		int mode = (pt->bGraphic?8:0) | (pt->bInsert?4:0)
+					| (pt->bAlterScreen?2:0) | (pt->bWraparound?1:0);
+		p = parse_runs[mode](pt, p, zz);
+	}
 
 	if ( !pt->bPrompt && pt->cursor_x>pt->iPrompt ) {
 		char *p=pt->buff+pt->cursor_x-pt->iPrompt;
 		if ( strncmp(p, pt->sPrompt, pt->iPrompt)==0 ) pt->bPrompt=TRUE;
 		pt->tl1len = pt->buff+pt->cursor_x - pt->tl1text;
 	}
-	tiny_Redraw();
+	if ( !pt->bHeadless ) tiny_Redraw();
 	ReleaseMutex(pt->mtx);
 }
 BOOL term_Echo(TERM *pt)
@@ -269,7 +447,7 @@ void term_Title(TERM *pt, char *title)
 	}
 	strncpy(pt->title, title, 63);
 	pt->title[63] = 0;
-	tiny_Title(pt->title);
+	if ( !pt->bHeadless ) tiny_Title(pt->title);
 }
 void term_Scroll(TERM *pt, int lines)
 {	
@@ -346,11 +524,13 @@ void term_Print(TERM *pt, const char *fmt, ...)
 	va_start(args, (char *)fmt);
 	int len = vsnprintf(buff, 4096, (char *)fmt, args);
 	va_end(args);
+	term_Drain(pt);
 	term_Parse(pt, buff, len);
 	term_Parse(pt, "\033[37m", 5);
 }
 void term_Disp(TERM *pt, const char *msg )
 {
+	term_Drain(pt);
 	pt->tl1text = pt->buff+pt->cursor_x;
 	term_Parse(pt, msg, strlen(msg));
 }
@@ -473,6 +653,12 @@ int term_TL1(TERM *pt, char *cmd, char **pTl1Text)
 }
 int term_Pwd(TERM *pt, char *pwd, int len)
 {
+	if ( pt->bCwd ) {				//reported with the prompt by OSC 7
+		if ( len>(int)strlen(pt->cwd) ) len = strlen(pt->cwd);
+		strncpy(pwd, pt->cwd, len);
+		pwd[len] = 0;
+		return len;
+	}
 	char *p1, *p2;
 	term_TL1(pt,"pwd\r", &p2);
 	p1 = strchr(p2, 0x0a);
@@ -503,6 +689,19 @@ int term_Scp(TERM *pt, char *cmd, char **preply)
 {
 	if ( host_Type(pt->host )!=SSH ) return 0; 
 
+	int limit = 0;						//-l Kbit/s, like scp
+	if ( strncmp(cmd, "-l ", 3)==0 ) {
+		limit = atoi(cmd+3);
+		char *p = strchr(cmd+3, ' ');
+		if ( p==NULL ) return 0;
+		cmd = p+1;
+	}
+	BOOL bBackground = FALSE;			//trailing & queues the transfer
+	int len = strlen(cmd);
+	if ( len>2 && strcmp(cmd+len-2, " &")==0 ) {
+		cmd[len-2] = 0;
+		bBackground = TRUE;
+	}
 	for ( char *q=cmd; *q; q++ ) if ( *q=='\\'&&q[1]!=' ' ) *q='/';
 	char *p = strchr(cmd, ' ');
 	while ( p!=NULL ) {
@@ -512,62 +711,59 @@ int term_Scp(TERM *pt, char *cmd, char **preply)
 
 	char *lpath, *rpath, *reply = term_Mark_Prompt(pt);
 	term_Learn_Prompt(pt);
+	//remote names are looked up on exec channels of the same session,
+	//nothing is typed into the shell except pwd if it doesn't send OSC 7
+	char rlist[1024] = "";
 	if ( *cmd==':' ) {	//scp_read
 		lpath = p; rpath = cmd+1;
 		escape_space(lpath);
-		char ls_1[1024]="ls -1 ";
 		if ( *rpath!='/' && *rpath!='~' ) {
-			term_Pwd(pt, ls_1+6, 1016);
-			strcat(ls_1, "/");
+			term_Pwd(pt, rlist, 1000);
+			strcat(rlist, "/");
 		}
-		strcat(ls_1, rpath);
-		
 		if ( strchr(rpath, '*')==NULL 
 		  && strchr(rpath, '?')==NULL ) {		//rpath is a single file
+			strcat(rlist, rpath);
+			strcat(rlist, "\012");
 			reply = term_Mark_Prompt(pt);	
-			strcat(ls_1, "\012");
-			scp_read(pt->host, lpath, ls_1+6);
+			scp_read(pt->host, lpath, rlist, bBackground, limit);
 		}
 		else {									//rpath is a filename pattern
-			char *rlist, *rfiles;
-			strcat(ls_1, "\r");
-			int len = term_TL1(pt, ls_1, &rlist);
-			if ( len>0 ) {
-				rlist[len] = 0;
-				p = strchr(rlist, 0x0a);
-				if ( p!=NULL ) {
-					rfiles = strdup(p+1);
+			char ls_1[4200] = "ls -1d ";		//pattern is left to the shell
+			if ( *rlist ) sh_quote(ls_1+7, rlist);
+			strcat(ls_1, rpath);
+			char *rfiles = (char *)malloc(65536);
+			if ( rfiles!=NULL ) {
+				if ( ssh2_Exec(pt->host, ls_1, rfiles, 65536)>0 ) {
 					reply = term_Mark_Prompt(pt);
-					scp_read(pt->host, lpath, rfiles);
-					free(rfiles);
+					scp_read(pt->host, lpath, rfiles, bBackground, limit);
 				}
+				else
+					term_Print(pt, "\033[31mno match for %s\r\n", rpath);
+				free(rfiles);
 			}
 		}
 	}
 	else {//scp_write
 		lpath = cmd; rpath = p+1;				//*p is expected to be ':' here
-		char lsld[1024]="ls -ld ";
 		if ( *rpath!='/' && *rpath!='~' ) {		//rpath is relative
-			term_Pwd(pt, lsld+7, 1017);
-			if ( *rpath ) strcat(lsld, "/");
+			term_Pwd(pt, rlist, 1000);
+			if ( *rpath ) strcat(rlist, "/");
 		}
-		strcat(lsld, rpath);
-		strcat(lsld, "\r");
-
-		if ( lsld[strlen(lsld)-1]!='/' )  {
-			char *rlist;			 
-			if ( term_TL1(pt, lsld, &rlist )>0 ) {//check if rpath is a dir
-				lsld[strlen(lsld)-1] = 0;
-				p = strchr(rlist, 0x0a);
-				if ( p!=NULL ) {				//append '/' if yes
-					if ( p[1]=='d' ) strcat(lsld, "/");
-				}
-			}
+		strcat(rlist, rpath);
+		escape_space(rlist);
+		escape_space(lpath);
+		if ( *rlist && rlist[strlen(rlist)-1]!='/' ) {//append '/' to a dir
+			char test_d[4200] = "test -d ", out[8];
+			int len = strlen(test_d);
+			len += sh_quote(test_d+len, rlist);
+			strcpy(test_d+len, " && echo d");
+			if ( ssh2_Exec(pt->host, test_d, out, sizeof(out))>0 
+											&& *out=='d' ) 
+				strcat(rlist, "/");
 		}
 		reply = term_Mark_Prompt(pt);
-		escape_space(lsld+7);
-		escape_space(lpath);
-		scp_write(pt->host, lpath, lsld+7);
+		scp_write(pt->host, lpath, rlist, bBackground, limit);
 	}
 	term_Send(pt, "\r", 1);
 	if ( preply!=NULL ) *preply = reply;
@@ -621,6 +817,31 @@ int term_Cmd(TERM *pt, char *cmd, char **preply)
 	else if ( strncmp(cmd, "Recv" ,4)==0 )	rc = term_Recv(pt, preply);
 	else if ( strncmp(cmd, "Echo", 4)==0 )	rc = term_Echo(pt ) ? 1 : 0;
 	else if ( strncmp(cmd, "Timeout",7)==0 )pt->iTimeOut = atoi( cmd+8);
+	else if ( strncmp(cmd, "Verify",6)==0 ) {
+		char *p = cmd+6;
+		while ( *p==' ' ) p++;
+		if ( strncmp(p, "on", 2)==0 ) pt->host->bVerify = TRUE;
+		if ( strncmp(p, "off", 3)==0 ) pt->host->bVerify = FALSE;
+		if ( preply!=NULL ) *preply = pt->host->bVerify ? "on" : "off";
+		rc = strlen(pt->host->bVerify ? "on" : "off");
+	}
+	else if ( strncmp(cmd, "Parallel",8)==0 ) {
+		int n = atoi(cmd+8);
+		if ( n>=1 && n<=32 ) pt->host->scp_jobs = n;
+	}
+	else if ( strncmp(cmd, "Connect",7)==0 ) {
+		HOST *ph = pt->host;
+		int ms = 0, delay = 0;
+		sscanf(cmd+7, "%d %d", &ms, &delay);
+		if ( ms>0 ) ph->connect_ms = ms;
+		if ( delay>0 ) ph->attempt_ms = delay;
+		term_Mark_Prompt(pt);
+		term_Print(pt, "timeout %d ms, attempt delay %d ms, "
+					"last %s dns %lu ms connect %lu ms\n",
+					ph->connect_ms, ph->attempt_ms, ph->peer,
+					ph->resolve_time, ph->connect_time);
+		rc = term_Recv(pt, preply);
+	}
 	else if ( strncmp(cmd, "Prompt",6)==0 ) {
 		if ( cmd[6]==' ' ) {
 			strncpy(pt->sPrompt, cmd+7, 31);
@@ -633,8 +854,27 @@ int term_Cmd(TERM *pt, char *cmd, char **preply)
 		if ( preply!=NULL ) *preply = pt->sPrompt;
 		rc = pt->iPrompt;
 	}
-	else if ( strncmp(cmd, "Tftpd",5)==0 )	tftp_Svr(cmd+5);
-	else if ( strncmp(cmd, "Ftpd", 4)==0 ) 	ftp_Svr(cmd+4);
+	else if ( strncmp(cmd, "Tftpd",5)==0 )	tftp_Svr(pt, cmd+5);
+	else if ( strncmp(cmd, "Ftpd", 4)==0 ) 	ftp_Svr(pt, cmd+4);
+	else if ( strncmp(cmd, "Stats",5)==0 ) {
+		term_Mark_Prompt(pt);
+		term_Print(pt, "ring %ld/%d bytes, max %ld, stalls %ld, total %lld\n",
+					(long)(pt->ring_head-pt->ring_tail), RINGSIZE,
+					pt->ring_max, pt->ring_stalls, pt->ring_bytes);
+		rc = term_Recv(pt, preply);
+	}
+	else if ( strncmp(cmd, "Xfer",4)==0 ) {
+		term_Mark_Prompt(pt);
+		if ( strncmp(cmd+4, " cancel", 7)==0 ) 
+			xfer_Cancel(pt->host, atoi(cmd+11));
+		xfer_List(pt);
+		rc = term_Recv(pt, preply);
+	}
+	else if ( strncmp(cmd, "Sessions",8)==0 ) {
+		term_Mark_Prompt(pt);
+		session_List(pt);
+		rc = term_Recv(pt, preply);
+	}
 	else if ( strncmp(cmd, "tun",  3)==0 ) 	rc = term_Tun(pt, cmd+3, preply);
 	else if ( strncmp(cmd, "scp ", 4)==0 ) 	rc = term_Scp(pt, cmd+4, preply);
 	else if ( strncmp(cmd, "xmodem ", 7)==0 ) rc = term_xmodem(pt, cmd+7);
@@ -811,7 +1051,7 @@ const unsigned char *vt100_Escape(TERM *pt, const unsigned char *sz, int cnt)
 				break;
 			case 'f': //horizontal and vertical position forced
 				for ( int i=pt->cursor_y+1; i<pt->screen_y+n1; i++ )
-					if ( i<MAXLINES && pt->line[i]<pt->cursor_x ) 
+					if ( i<pt->max_lines && pt->line[i]<pt->cursor_x ) 
 						pt->line[i]=pt->cursor_x;
 			case 'H': //cursor to line n1, postion n0
 				if ( !pt->bAlterScreen && n1>pt->size_y ) {
@@ -836,7 +1076,7 @@ const unsigned char *vt100_Escape(TERM *pt, const unsigned char *sz, int cnt)
 					pt->line[pt->cursor_y+1] = pt->cursor_x;
 					for ( int i=pt->cursor_y+2; 
 							  i<=pt->screen_y+pt->size_y+1; i++ )
-						if ( i<MAXLINES ) pt->line[i] = 0;
+						if ( i<pt->max_lines ) pt->line[i] = 0;
 				}
 				break;
 			case 'K': {	//[K kill till end, 1K begining, 2K entire line
@@ -954,7 +1194,7 @@ const unsigned char *vt100_Escape(TERM *pt, const unsigned char *sz, int cnt)
 					if ( n0==3 ) { 
 						if (pt->size_x!=132 || pt->size_y!=25 ) {
 							pt->size_x = 132;   pt->size_y = 25;
-							wnd_Size();
+							if ( !pt->bHeadless ) wnd_Size();
 						}
 						screen_clear(pt, 2);
 					}
@@ -976,7 +1216,7 @@ const unsigned char *vt100_Escape(TERM *pt, const unsigned char *sz, int cnt)
 					if ( n0==3 ) {
 						if (pt->size_x!=80 || pt->size_y!=25 ) {
 							pt->size_x = 80;   pt->size_y = 25;
-							wnd_Size();
+							if ( !pt->bHeadless ) wnd_Size();
 						}
 						screen_clear(pt, 2);
 					}
@@ -1114,6 +1354,12 @@ const unsigned char *vt100_Escape(TERM *pt, const unsigned char *sz, int cnt)
 				if (pt->escape_code[1]=='0' ) {
 					pt->bTitle = TRUE;
 					pt->title_idx = 0;
+					pt->osc_code = 0;
+				}
+				if (pt->escape_code[1]=='7' && pt->escape_idx==3 ) {
+					pt->bTitle = TRUE;		//working dir, file://host/path
+					pt->title_idx = 0;
+					pt->osc_code = 7;
 				}
 				pt->bEscape = FALSE;
 			}
@@ -92,11 +92,11 @@ FILE * fopen_utf8(const char *fn, const char *mode)
 	utf8_to_wchar(mode, strlen(mode)+1, wmode, 4);
 	return _wfopen(wfn, wmode);
 }
-int stat_utf8(const char *fn, struct _stat *buffer)
+int stat_utf8(const char *fn, struct _stat64 *buffer)
 {
 	WCHAR wfn[MAX_PATH];
 	utf8_to_wchar(fn, strlen(fn)+1, wfn, MAX_PATH);
-	return _wstat(wfn, buffer);
+	return _wstat64(wfn, buffer);
 }
 
 WCHAR *fileDialog( WCHAR *szFilter, DWORD dwFlags )
@@ -302,10 +302,6 @@ LRESULT APIENTRY CmdEditProc(HWND hwnd, UINT uMsg,
 	return CallWindowProc(wpOrigCmdProc, hwnd, uMsg, wParam, lParam);
 }
 
-char *tiny_Gets(char *prompt, BOOL bEcho)
-{
-	return ssh2_Gets(ph, prompt, bEcho);
-}
 static BOOL redraw_pending=FALSE;
 void tiny_Redraw()
 {
@@ -749,11 +745,11 @@ BOOL menu_Command( WPARAM wParam, LPARAM lParam )
 		if ( fontDialog() ) wnd_Size();
 		break;
 	case ID_FTPD:
-		bFTPd = ftp_Svr(bFTPd?NULL:getFolderName(L"Choose root directory"));
+		bFTPd = ftp_Svr(pt, bFTPd?NULL:getFolderName(L"Choose root directory"));
 		menu_Check( ID_FTPD, bFTPd );
 		break;
 	case ID_TFTPD:
-		bTFTPd = tftp_Svr(bTFTPd?NULL:getFolderName(L"Choose root directory"));
+		bTFTPd = tftp_Svr(pt, bTFTPd?NULL:getFolderName(L"Choose root directory"));
 		menu_Check( ID_TFTPD, bTFTPd );
 		break;
 	case ID_RUN: {
@@ -1049,16 +1045,19 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance,
 	WSADATA wsaData;
 	WSAStartup(MAKEWORD(2, 2), &wsaData);
 	libssh2_init(0);
+	ssh2_Init();
+	reactor_Init();
 	httport = http_Svr("127.0.0.1");
 
 	TERM term;
 	HOST host;
 	pt = &term;
 	ph = &host;
-	if ( !term_Construct(pt) ) return 0;
+	if ( !term_Construct(pt, MAXLINES) ) return 0;
 	host_Construct(ph);
 	term.host = ph;
 	host.term = pt;
+	session_Add(pt);			//main window is always session 0
 
 	HDC sysDC = GetDC(0);
 	dpi = GetDeviceCaps(sysDC, LOGPIXELSX);
@@ -1209,9 +1208,11 @@ DWORD WINAPI uploader(void *files)	//upload files through scp or sftp
 		p1 = strchr(p, 0x0a);
 		if ( p1!=NULL ) *p1++=0;
 		if ( ph->type==SSH )
-			scp_write(ph, p, rdir);
-		else
-			sftp_put(ph, p, ph->realpath);
+			scp_write(ph, p, rdir, TRUE, 0);	//queued, shell stays usable
+		else if ( sftp_Lock(ph) ) {
+			sftp_put(ph, p, ph->realpath, FALSE);	//not while prefetching
+			ReleaseMutex(ph->mtx_sftp);
+		}
 	}
 	bScriptRun = bScriptPause = FALSE;
 	PostMessage(hwndTerm, WM_COMMAND, ID_QUIT, 0);
@@ -23,10 +23,20 @@
 
 #define MAXLINES 16384
 #define BUFFERSIZE 16384*64
+#define MAXSESSIONS 256
+#define RINGSIZE 65536				//reader to parser ring, power of 2
 
+struct Bucket						//token bucket, limits a transfer or tunnel
+{
+	int rate;						//bytes per second, 0 is unlimited
+	int tokens;
+	DWORD tick;						//last refill
+};
+
+enum tunType {TUN_LOCAL, TUN_REMOTE, TUN_SOCKS};//-L, -R and -D forwards
 struct Tunnel
 {
-	int socket;
+	int socket;						//-R listener has -port, no socket
 	char *localip;
 	char *remoteip;
 	unsigned short localport;
@@ -34,6 +44,37 @@ struct Tunnel
 	LIBSSH2_CHANNEL *channel;
 	struct Tunnel *next;
 	struct tagHOST *host;
+	int type;
+	LIBSSH2_LISTENER *listener;		//-R, listening on the server
+	volatile BOOL bClose;			//-R listener, closed by owner thread
+	BOOL bReply;					//-D, SOCKS reply due when channel opens
+	int closing;					//0 relaying, 1 channel closing, 2 freeing
+	int parent;						//socket of the listener, 0 if none
+	long long tx, rx;				//bytes into and out of ssh, a listener
+									//adds those of its closed connections
+	int accepted, opened;			//listener, connections taken and opened
+	DWORD start;					//when it was accepted
+	DWORD open_ms;					//channel open time, a listener's total
+	long long win_bytes;			//tx+rx at win_tick
+	DWORD win_tick;
+	int rate;						//bytes/s over the last second
+	char buf[65536];				//read from socket, not yet sent to host
+	int buflen, bufoff;
+	char dbuf[65536];				//read from host, not yet sent to socket
+	int dlen, doff;
+	struct Bucket bucket;			//rate limit, copied from the listener
+};
+
+struct Job							//libssh2 work run by the session owner
+{
+	int (*step)(struct tagHOST *ph, struct Job *job);//0 done, <0 blocked
+	void *ctx;
+	SOCKET sock;					//local socket to poll, if any
+	short events, revents;			//POLLRDNORM by default
+	BOOL bCancel;					//session is closing, clean up and quit
+	int rc;
+	HANDLE hDone;					//NULL if nobody waits for the result
+	struct Job *next;
 };
 
 typedef struct tagHOST {
@@ -42,22 +83,44 @@ typedef struct tagHOST {
 
 	char cmdline[256];
 	char tunline[256];
+	char hostbuf[256];				//hostname for readers run by reactor
 	SOCKET sock;					//for tcp/ssh/sftp reader
 	short port;
+	int connect_ms, attempt_ms;		//connect time out, delay between attempts
+	DWORD resolve_time, connect_time;//last connect, connect_time includes dns
+	char peer[64];					//address last connected to
+	HANDLE hThread;					//reader thread, joined before destroy
 	HANDLE hExitEvent, hSerial;		//for serial reader
 	HANDLE hStdioRead, hStdioWrite;	//for stdio reader
+	PROCESS_INFORMATION piStd;		//child process of stdio reader
+
+	FILE *xmodem_fp;				//xmodem sender over serial
+	unsigned char xmodem_buf[133];
+	unsigned char xmodem_blk;
+	int xmodem_timeout;
+	BOOL bXmodem, xmodem_crc, xmodem_started;
 
 	char *subsystem;
 	char *username;
 	char *password;
 	char *passphrase;
 	char *hostname;
+	char *jumphost;					//-J, ssh over a tunnel of this session
 	char homedir[MAX_PATH];
 	char keys[256];
 	int cursor;
 	BOOL bReturn, bPassword, bGets;
+	BOOL bBatch;					//nobody answers prompts, bastion for a jump
 
-	HANDLE mtx;						//ssh2 reading/writing mutex
+	HANDLE mtx_job;					//job and keystroke queue mutex
+	SOCKET wake_s;					//wakes up the session owner thread
+	struct Job *job_list;			//jobs queued by other threads
+	struct Job *job_run;			//jobs running, owner thread only
+	char kbuf[4096];				//keystrokes waiting to be sent
+	int klen;
+	DWORD poll_ms;					//shortened by jobs waiting for tokens
+	int size_w, size_h;
+	BOOL bResize, bClose;
 	LIBSSH2_SESSION *session;
 	LIBSSH2_CHANNEL *channel;
 	HANDLE mtx_tun;					//tunnel list add/delete mutex
@@ -67,26 +130,54 @@ typedef struct tagHOST {
 	char homepath[MAX_PATH];
 	char realpath[MAX_PATH];
 	int sftp_running;
+	HANDLE mtx_sftp;				//sftp thread or prefetch uses the session
+	HANDLE mtx_rdir;				//remote directory cache
+	struct rdir *rdir_list;
+	volatile LONG rdir_gen, rdir_threads;//prefetch started, still running
+	volatile LONG sftp_waiting;		//commands waiting for mtx_sftp
+	int sftp_window;				//sftp requests kept in flight
+	int scp_jobs;					//scp files transferred at the same time
+	BOOL bVerify;					//check sha-256 after scp/sftp transfers
 
 	struct tagTERM *term;
 } HOST;
 
 typedef struct tagTERM {
+	int id;							//session id for scripting interface
+	BOOL bHeadless;					//session not shown in the main window
+	volatile LONG refs;				//slot and session_Get callers, freed at 0
 	char *buff, *attr, c_attr, save_attr;
 	int *line;
+	int buff_size, max_lines;		//scroll back buffer size in bytes/lines
 	int size_x, size_y;
 	int cursor_x, cursor_y;
 	int screen_y;
 	int sel_left, sel_right;
 	BOOL bLogging, bEcho, bCursor, bAlterScreen;
 	BOOL bAppCursor, bGraphic, bEscape, bTitle, bInsert;
+	BOOL bST;						//ESC ended an OSC, \ may follow
 	BOOL bBracket, bOriginMode, bWraparound;//bracketed paste mode
 	int save_x, save_y;
 	int roll_top, roll_bot;
 	HANDLE mtx;						//term parse mutex
+	HANDLE mtx_cmd;					//one scripting command at a time
+
+	char *ring;						//bytes from reader, for parser thread
+	volatile LONG ring_head;		//free running, moved by reader only
+	volatile LONG ring_tail;		//free running, moved by parser only
+	volatile BOOL bStalled;			//reader paused on a full ring
+	BOOL bParser;
+	HANDLE hParser, hRingData, hRingSpace;
+	DWORD parser_tid;
+	LONG ring_max, ring_stalls;		//high water mark, full ring count
+	LONGLONG ring_bytes;
 
 	char title[64];
 	int title_idx;
+	int osc_code;					//0 title, 7 working dir
+	char osc[MAX_PATH];				//OSC 7 being collected
+	char cwd[MAX_PATH];				//shell working dir, from OSC 7
+	BOOL bCwd;						//OSC 7 came after the last line feed
 	FILE *fpLogFile;
 
 	BOOL bPrompt;
@@ -130,26 +221,53 @@ int host_Status(HOST *ph);
 int host_tcp(HOST *ph);
 void xmodem_init(HOST *ph, FILE *fp);
 
+typedef void (*reactor_callback)(SOCKET s, void *arg);
+BOOL reactor_Init();
+BOOL reactor_Add(SOCKET s, reactor_callback cb, void *arg);
+void reactor_Del(SOCKET s);
+void reactor_Pause(SOCKET s, BOOL bPause);
+void host_Resume(HOST *ph);
+SOCKET wake_Socket();
+
 int url_decode(char *url);
 int http_Svr(char *intf);
-BOOL ftp_Svr(char *root);
-BOOL tftp_Svr(char *root);
+BOOL ftp_Svr(struct tagTERM *pt, char *root);
+BOOL tftp_Svr(struct tagTERM *pt, char *root);
+
+int  session_Add(struct tagTERM *pt);
+struct tagTERM *session_Get(int id, BOOL bCreate);
+void session_Put(struct tagTERM *pt);
+BOOL session_Free(int id);
+HOST *session_Find(const char *hostname, short port);
+void session_List(struct tagTERM *pt);
 
 /****************ssh2.c****************/
+void ssh2_Init();
 void ssh2_Construct(HOST *ph);
 void ssh2_Size(HOST *ph, int w, int h);
 void ssh2_Send(HOST *ph, char *buf, int len);
 char *ssh2_Gets(HOST *ph, char *prompt, BOOL bEcho);
 void ssh2_Close(HOST *ph);
+void ssh2_Wake(HOST *ph);
+int  ssh2_Job(HOST *ph, int (*step)(HOST *, struct Job *), void *ctx,
+															BOOL bWait);
+int  ssh2_Exec(HOST *ph, const char *cmd, char *out, int size);
+int  sh_quote(char *out, const char *path);
 void ssh2_Tun(HOST *ph, char *cmd);
-void scp_read(HOST *ph, char *lpath, char *rfiles);
-void scp_write(HOST *ph, char *lpath, char *rpath);
-void sftp_put(HOST *ph, char *src, char *dst);
+void scp_read(HOST *ph, char *lpath, char *rfiles, BOOL bBackground,
+																int limit);
+void scp_write(HOST *ph, char *lpath, char *rpath, BOOL bBackground,
+																int limit);
+void xfer_List(struct tagTERM *pt);
+BOOL xfer_Cancel(HOST *ph, int id);
+void xfer_Drop(HOST *ph);
+void sftp_put(HOST *ph, char *src, char *dst, BOOL bResume);
+BOOL sftp_Lock(HOST *ph);
 void sftp_Close(HOST *ph);
 
 /****************term.c****************/
 void host_callback( void *term, char *buf, int len);
-BOOL term_Construct(TERM *pt);
+BOOL term_Construct(TERM *pt, int lines);
 void term_Destruct(TERM *pt);
 void term_Size(TERM *pt, int x, int y);
 void term_Title(TERM *pt, char *title);
@@ -158,6 +276,8 @@ void term_Scroll(TERM* pt, int lines);
 void term_Mouse(TERM *pt, int evt, int x, int y);
 void term_Print(TERM *pt, const char *fmt, ...);
 void term_Parse(TERM *pt, const char *buf, int len);
+int  term_Room(TERM *pt);
+int  term_Feed(TERM *pt, const char *buf, int len, BOOL bWait);
 void term_Parse_XML(TERM *pt, const char *xml, int len);
 
 BOOL term_Echo(TERM *pt);
@@ -181,7 +301,7 @@ int term_Cmd(TERM *pt, char *cmd, char **preply);
 /****************tiny.c****************/
 int utf8_to_wchar(const char *buf, int cnt, WCHAR *wbuf, int wcnt);
 int wchar_to_utf8(WCHAR *wbuf, int wcnt, char *buf, int cnt);
-int stat_utf8(const char *fn, struct _stat *buffer);
+int stat_utf8(const char *fn, struct _stat64 *buffer);
 FILE *fopen_utf8(const char *fn, const char *mode);
 
 void cmd_Disp_utf8(char *buf);
@@ -192,4 +312,3 @@ void wnd_Size();		//resize window when font or term size changes
 void tiny_Redraw();		//redraw term window
 void tiny_Title(char *buf);
 BOOL tiny_Scroll(BOOL bShowScroll, int cy, int sy);//return if scrollbar is shown
-char *tiny_Gets(char *prompt, BOOL bEcho);